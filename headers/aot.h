@@ -0,0 +1,65 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <vector>
+
+/* Ahead-of-time translated ROMs
+recomp (src/recomp.cpp) follows a ROM's control flow from 0x200 (see cfg.h) and writes each
+basic block out as C++: register arithmetic, skips and jumps inline, everything else a call
+to the handler the interpreter would have used. The blocks become labels in one function, and
+jumps, calls and skips whose targets are known at translation time are plain gotos, so the
+compiler optimizes across the whole ROM. Files built into a program register themselves
+before main() runs, and ENGINE_AOT picks the one made from the loaded ROM for the variant it
+runs with.
+
+Each block checks on entry that it still has the cycles for all of its instructions and that
+the ROM hasn't written over its code. If not, or when pc lands where no block starts (BNNN
+and returns into code the translation never reached), run() goes back to aot::run(), which
+takes one instruction on the interpreter and tries again, or hands what is left of a frame
+too short for the block at pc to the threaded engine. Backward jumps, FX0A and 00FD go
+through the same idle checks as on the other engines. A ROM with no translation runs on the
+threaded engine, so ENGINE_AOT is always safe to ask for.
+*/
+struct aot_block {
+    WORD start;
+    WORD bytes; // of memory its code was translated from, including a word a skip looked at
+};
+
+struct aot_program {
+    uint64_t hash;          // fnv1a of the ROM file
+    Variant variant;        // whose quirks are compiled in
+    const char *name;       // the ROM it was made from, for listings
+    const BYTE *image;      // memory from 0 as load() leaves it, up to the end of the last block
+    size_t image_size;
+    const aot_block *blocks;
+    int count;
+    // Runs from c.pc for at most cycles instructions and returns the cycles it didn't use.
+    // live[i] is 0 once the ROM wrote over blocks[i].
+    int (*run)(chip8 &c, const BYTE *live, int cycles);
+};
+
+// Generated files register their program from a static initializer
+struct aot_registration {
+    explicit aot_registration(const aot_program &p);
+};
+const std::vector<const aot_program *> &aot_programs();
+const aot_program *aot_find(uint64_t hash, Variant v);
+
+class aot {
+    private:
+    chip8 &c;
+    const aot_program *program = nullptr;
+    std::vector<BYTE> live; // one per block of program
+    short block_at [CODE_SIZE]; // block of program that starts at each address, -1 where none does
+
+    public:
+    explicit aot(chip8 &owner) : c(owner) {}
+
+    void bind();
+    void run(int cycles);
+    void invalidate(WORD addr);
+    const aot_program *bound() const { return program; }
+
+    BYTE covered [CODE_SIZE] = {}; // live blocks that include each byte
+};
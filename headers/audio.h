@@ -0,0 +1,57 @@
+#pragma once
+
+#include "bytes.h"
+#include "lockfree.h"
+
+#include <cstring>
+
+#include <SDL2/SDL.h>
+
+using namespace bytes;
+
+// What the buzzer should be playing. Until an XO-CHIP ROM loads an audio pattern it is the one
+// CHIP-8 tone.
+struct tone {
+    bool on = false;
+    bool pattern_set = false;
+    BYTE pitch = 64;        // XO-CHIP FX3A, 64 plays the pattern at 4000 bits per second
+    BYTE pattern [16] = {}; // 128 one bit samples, MSB first, played in a loop
+
+    bool operator==(const tone &o) const {
+        return on == o.on && pattern_set == o.pattern_set && pitch == o.pitch
+            && memcmp(pattern, o.pattern, sizeof(pattern)) == 0;
+    }
+    bool operator!=(const tone &o) const { return !(*this == o); }
+};
+
+/* Buzzer
+CHIP-8 has one tone, on while the sound timer is above zero. The emulation thread calls set()
+when that changes, or when an XO-CHIP ROM changes its pattern or pitch, which only pushes the
+new tone into a lock-free ring. SDL's audio callback drains the ring at the start of every
+buffer and synthesizes the wave itself, a square wave or the pattern's bits, so there is
+nothing to underrun: with no news it keeps playing the tone or the silence it was already
+playing. Buffers are short enough that the tone starts and stops within a frame, and the level
+ramps over a couple of milliseconds so the edges don't click.
+*/
+class audio {
+    private:
+    SDL_AudioDeviceID device = 0;
+    spsc_queue<tone, 64> changes; // from the emulation thread
+    int rate = 0; // samples per second the device runs at
+
+    // Audio callback thread only
+    tone playing;
+    double phase = 0;   // position in the current square wave period, 0 to 1, or in the pattern, 0 to 128
+    double step = 0;    // period fraction per sample
+    double pattern_step = 0; // pattern bits per sample at the current pitch
+    float level = 0;    // volume now, follows `on` one ramp step per sample
+    float ramp = 0;
+
+    static void callback(void *self, Uint8 *stream, int len);
+    void fill(Sint16 *out, int samples);
+
+    public:
+    ~audio();
+    bool init();
+    bool set(const tone &t);
+};
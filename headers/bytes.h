@@ -1,3 +1,5 @@
+#pragma once
+
 namespace bytes {
     typedef unsigned char BYTE; // 8 bits
     typedef unsigned short int WORD; // 16 bits
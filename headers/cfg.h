@@ -0,0 +1,46 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <string>
+#include <vector>
+
+/* Control flow graph
+Finds a ROM's code the way the machine would run into it: from 0x200, straight on, into
+jumps and calls, back from calls to the instruction after them, and down both sides of every
+skip. Where BNNN jumps and where 00EE returns to are only known at run time, so code only
+those reach isn't found, and bytes nothing reaches are taken for data. Instructions are
+decoded by the machine itself, with the quirks of its variant.
+
+A block ends after anything that jumps, calls, returns or skips, after FX0A and 00FD (they
+run again until a key comes, or for good), after FX33, FX55 and 5XY2 (they may rewrite code),
+and before any address something else jumps to. FX0A and 00FD always start their own block,
+so they can go back to it. Code has to fit below 0x1000, including the word an XO-CHIP skip
+looks at, and stops where it wouldn't. recomp translates the blocks (see aot.h) and prints
+them as a listing.
+*/
+struct cfg_block {
+    WORD start;
+    WORD end;       // address after the last instruction
+    WORD last;      // address of the last instruction
+    BYTE last_kind; // and its Opcode
+    int count;      // instructions
+    WORD bytes;     // of memory the block depends on, end - start plus a word a skip looked at
+    std::vector<WORD> next; // blocks control can go to afterwards, where that is known
+    bool computed;  // ends in 00EE, BNNN or an invalid opcode, which can go anywhere
+};
+
+struct rom_cfg {
+    std::vector<cfg_block> blocks;      // sorted by start
+    std::vector<WORD> calls;            // subroutine entry points, sorted
+    std::vector<WORD> computed_jumps;   // addresses of BNNN instructions
+    BYTE code [CODE_SIZE] = {};         // 1 for every byte of an instruction that was reached
+    size_t rom_end = 0x200;             // address after the last byte of the ROM
+
+    void build(const chip8 &c, size_t rom_size);
+    int find(WORD start) const;         // block that starts at start, -1 if none does
+    std::string listing(const chip8 &c) const;
+};
+
+// Bytes the instruction takes, 4 for XO-CHIP's F000 NNNN
+inline int instruction_size(Opcode kind) { return kind == OPC_F000 ? 4 : 2; }
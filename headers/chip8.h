@@ -1,12 +1,21 @@
+#pragma once
+
 #include "bytes.h"
+#include "profiler.h"
+#include "trace.h"
+#include "quirks.h"
 
 #include <iostream>
 #include <vector>
 #include <string>
 #include <sstream>
 #include <cstring> // gives memset
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
 
-// used for creating random seed, used by opcode CXNN
+// used for creating the default random seed, used by opcode CXNN
 #include <cstdlib> 
 #include <ctime>
 
@@ -15,10 +24,100 @@ using namespace bytes;
 // enum to index into registers array
 enum Register {V0=0, V1, V2, V3, V4, V5, V6, V7, V8, V9, VA, VB, VC, VD, VE, VF /*carry flag*/};
 
-class chip8 {
-    private:
+// enum to identify decoded instructions, also indexes the handler and label tables
+enum Opcode {
+    OPC_0NNN=0, OPC_00E0, OPC_00EE, OPC_1NNN, OPC_2NNN, OPC_3XNN, OPC_4XNN, OPC_5XY0, OPC_6XNN, OPC_7XNN,
+    OPC_8XY0, OPC_8XY1, OPC_8XY2, OPC_8XY3, OPC_8XY4, OPC_8XY5, OPC_8XY6, OPC_8XY7, OPC_8XYE, OPC_9XY0,
+    OPC_ANNN, OPC_BNNN, OPC_CXNN, OPC_DXYN, OPC_EX9E, OPC_EXA1, OPC_FX07, OPC_FX0A, OPC_FX15, OPC_FX18,
+    OPC_FX1E, OPC_FX29, OPC_FX33, OPC_FX55, OPC_FX65,
+    // SUPER-CHIP, only decoded when the variant has the schip quirk
+    OPC_00CN, OPC_00FB, OPC_00FC, OPC_00FD, OPC_00FE, OPC_00FF, OPC_DXY0, OPC_FX30, OPC_FX75, OPC_FX85,
+    // XO-CHIP, only decoded when the variant has the xochip quirk
+    OPC_00DN, OPC_5XY2, OPC_5XY3, OPC_F000, OPC_FN01, OPC_F002, OPC_FX3A,
+    OPC_INVALID, OPC_COUNT
+};
+
+/* Execution engines
+INTERPRETER calls the cached handler for one instruction per cycle().
+THREADED uses GCC/Clang computed goto so every handler jumps straight to the next one.
+JIT translates basic blocks to x86-64 code, see jit.h.
+AOT runs ROMs that recomp translated to C++ ahead of time and that were linked into the
+program, see aot.h. Any other ROM runs on the threaded engine.
+Engines the build doesn't support (no computed goto, not x86-64 Linux, or turned off with
+-DCHIP8_NO_THREADED / -DCHIP8_NO_JIT) fall back to the next simpler one.
+*/
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(CHIP8_NO_THREADED)
+#define CHIP8_HAS_THREADED 1
+#else
+#define CHIP8_HAS_THREADED 0
+#endif
+#if defined(__x86_64__) && defined(__linux__) && !defined(CHIP8_NO_JIT)
+#define CHIP8_HAS_JIT 1
+#else
+#define CHIP8_HAS_JIT 0
+#endif
+enum Engine {ENGINE_INTERPRETER=0, ENGINE_THREADED, ENGINE_JIT, ENGINE_AOT};
+
+// XO-CHIP's 64 KB. The other variants only reach the first 4 KB (CODE_SIZE), and code runs
+// from there on every variant since jumps and calls can't go any higher.
+const size_t MEMORY_SIZE = 0x10000;
+const size_t CODE_SIZE = 0x1000;
+const size_t MAX_ROM_SIZE = MEMORY_SIZE - 0x200;
+const int PLANES = 4;
+
+/* Machine state
+Everything a ROM can see or change, kept in one fixed-size block with no pointers in it, so
+a snapshot is a single memcpy. Fields are ordered widest first so there is no padding and two
+states can be compared with memcmp, except memory, which goes last: past the first 4 KB it
+stays 0 unless an XO-CHIP ROM puts something there, so chip8::state_size() can cut the block
+off where the 0s start and the rewind buffer never walks the rest. Anything that can be
+rebuilt from this block (the instruction cache, JIT blocks, dirty rows) lives in chip8 itself.
+*/
+struct machine_state {
+    // Graphics
+    // One bit packed screen per XO-CHIP bit plane, display[plane][row][word]. Two words per
+    // row, pixel x of a row is bit (63 - x % 64) of word x / 64, so the leftmost pixel is the
+    // MSB of the first word. The screen is stored at the resolution it is in: 64x32 uses the
+    // first word of the first 32 rows and leaves the rest 0, the SUPER-CHIP 128x64 mode
+    // (hires) uses all of it. Only XO-CHIP ROMs ever draw on planes other than the first.
+    // expand_display() gives one byte per pixel of the first plane instead.
+    uint64_t display [PLANES][64][2];
+
+    uint64_t rng; // xorshift64* state behind CXNN, never 0
+
+    // Stack
+    WORD stack [16]; // return addresses, the original interpreter had room for 16 levels
+    WORD I; // address register
+    WORD pc; // program counter
+
+    // Registers
+    BYTE registers [16];
+
+    // Input
+    BYTE keys [16];
+
+    // SUPER-CHIP RPL user flags, FX75 and FX85 save and load registers here
+    BYTE rpl [16];
+
+    // XO-CHIP audio: 128 one bit samples F002 loads, played at the rate FX3A picks
+    BYTE pattern [16];
+
+    BYTE sp; // next free stack slot, wraps around at 16
+
+    // Timers
+    BYTE delay_timer;
+    BYTE sound_timer;
+
+    BYTE hires; // 1 in the SUPER-CHIP 128x64 mode
+    BYTE planes; // bit plane mask FN01 selects, drawing, clearing and scrolling only touch these
+    BYTE pitch; // FX3A, 64 is 4000 samples per second
+    BYTE pattern_set; // 1 once F002 ran, until then the buzzer is the plain tone
+
+    BYTE reserved [5]; // keeps the size a multiple of 8, always 0
+
     /* Memory
-    Memory Map from http://devernay.free.fr/hacks/chip8/C8TECH10.HTM
+    Memory Map from http://devernay.free.fr/hacks/chip8/C8TECH10.HTM, XO-CHIP adds 0x1000 to
+    0xFFFF for data, which only F000 NNNN and I counting up from there can reach
     +---------------+= 0xFFF (4095) End of Chip-8 RAM
     |               |
     |               |
@@ -42,17 +141,33 @@ class chip8 {
     |  interpreter  |
     +---------------+= 0x000 (0) Start of Chip-8 RAM
     */
-    BYTE memory [4096];  // = 0xFFF 
+    BYTE memory [MEMORY_SIZE];  // = 0xFFFF, any WORD is a valid index
+};
+static_assert(std::is_trivially_copyable<machine_state>::value, "machine_state is copied with memcpy");
+static_assert(sizeof(machine_state) == 69752, "machine_state must not have padding, it is compared with memcmp");
+static_assert(offsetof(machine_state, memory) % 8 == 0, "state_size() cuts the block off at a whole 64-bit word");
 
-    // Registers
-    BYTE registers [16];
-    WORD I; // address register
+// Save state files: this header followed by the raw machine_state in host byte order, cut off
+// where its memory is all 0 from there on
+const char STATE_MAGIC[4] = {'C', '8', 'S', 'T'};
+const uint32_t STATE_VERSION = 5; // 2 added the random generator, 3 the SUPER-CHIP screen and flags, 4 XO-CHIP, 5 moved memory last
+struct state_header {
+    char magic [4];
+    uint32_t version;
+    uint32_t size; // bytes of machine_state that follow, at most sizeof(machine_state)
+};
 
-    // Stack
-    std::vector<WORD> stack;
-    WORD stack_ptr; // don't use b/c vector
-    WORD pc; // program counter
-    
+class jit;
+class aot;
+template <class ROM> struct aot_code;
+
+class chip8 : protected machine_state {
+    friend class jit;
+    friend class aot;
+    // Code recomp generated, one specialization per ROM, runs on the machine like the handlers do
+    template <class ROM> friend struct aot_code;
+
+    private:
     const BYTE font[80] = // Sprites
     { 
         // 0
@@ -168,32 +283,226 @@ class chip8 {
         0x80  //    *       10000000  
     };
 
+    // SUPER-CHIP 8x10 digits for FX30, right after the small ones in memory. The original only
+    // had 0-9, A-F are the ones Octo and XO-CHIP added.
+    static const WORD BIG_FONT = 0x50;
+    const BYTE big_font[160] =
+    {
+        0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, // 0
+        0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF, // 1
+        0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // 2
+        0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 3
+        0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03, // 4
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 5
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 6
+        0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18, // 7
+        0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, // 8
+        0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, // 9
+        0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+        0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, // B
+        0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C, // C
+        0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+    };
+
+    /* Pre-decoded instruction cache
+    One entry per address, filled the first time pc lands there. Each entry holds the handler
+    and the operands already pulled out of the opcode, so a cache hit skips both the masking
+    and the switch in decode(). Any write to memory clears the entries that cover that byte,
+    which keeps self-modifying ROMs correct.
+    */
+    struct instr;
+    typedef void (*handler)(chip8 &c, const instr &op);
+    struct instr {
+        handler fn; // nullptr until decoded
+        WORD nnn;   // lowest 12 bits
+        BYTE x;     // lower 4 bits of high byte
+        BYTE y;     // upper 4 bits of low byte
+        BYTE n;     // lowest 4 bits
+        BYTE nn;    // lowest 8 bits
+        BYTE kind;  // Opcode, picks the label in the threaded engine
+    };
+    instr icache [CODE_SIZE];
+
+    // Plain function pointers are cheaper to call than member function pointers, so the cache
+    // stores one of these per handler and the handler itself gets inlined into it
+    template <void (chip8::*H)(const instr &)>
+    static void call(chip8 &c, const instr &op) { (c.*H)(op); }
+
+    // One table per variant, set_variant() picks the one decode() fills the cache from
+    template <class Q>
+    static const handler handlers[OPC_COUNT];
+    const handler *handler_table;
+    void (chip8::*threaded)(int cycles); // run_threaded for the same variant
+    Variant variant = VARIANT_DEFAULT;
+    quirk_flags quirks;
+    template <class Q>
+    void use_quirks();
+
+    Engine engine = CHIP8_HAS_THREADED ? ENGINE_THREADED : ENGINE_INTERPRETER;
+    std::unique_ptr<jit> jit_engine;
+    std::unique_ptr<aot> aot_engine;
+    // Per-byte block count of the JIT or the AOT engine, null unless one of them is on
+    const BYTE *code_covered = nullptr;
+    uint64_t rom_hash = 0; // fnv1a of the ROM load() copied in, taken before it could write over itself
+    size_t memory_top = CODE_SIZE; // memory from here up is all 0, a multiple of 8
+    uint64_t rng_seed; // load() and reset() restart the generator from here
+    int call_depth = 0; // nested calls, only for telling a full stack from an empty one in the trace
+
+    // xorshift64*, each instance has its own so runs are repeatable and threads don't share state
+    BYTE random_byte() {
+        rng ^= rng >> 12;
+        rng ^= rng << 25;
+        rng ^= rng >> 27;
+        return (BYTE)((rng * 2685821657736338717ull) >> 56);
+    }
+
     // Functions
-    WORD fetch(); 
-    void decode(WORD opcode);
-
-    // execute - opcode functions
-    void opc0NNN(WORD opcode); void opc00E0(); void opc00EE(); void opc1NNN(WORD opcode); void opc2NNN(WORD opcode); 
-    void opc3XNN(WORD opcode); void opc4XNN(WORD opcode); void opc5XY0(WORD opcode); void opc6XNN(WORD opcode); void opc7XNN(WORD opcode);
-    void opc8XY0(WORD opcode); void opc8XY1(WORD opcode); void opc8XY2(WORD opcode); void opc8XY3(WORD opcode); void opc8XY4(WORD opcode);
-    void opc8XY5(WORD opcode); void opc8XY6(WORD opcode); void opc8XY7(WORD opcode); void opc8XYE(WORD opcode); void opc9XY0(WORD opcode);
-    void opcANNN(WORD opcode); void opcBNNN(WORD opcode); void opcCXNN(WORD opcode); void opcDXYN(WORD opcode); void opcEX9E(WORD opcode); 
-    void opcEXA1(WORD opcode); void opcFX07(WORD opcode); void opcFX0A(WORD opcode); void opcFX15(WORD opcode); void opcFX18(WORD opcode); 
-    void opcFX1E(WORD opcode); void opcFX29(WORD opcode); void opcFX33(WORD opcode); void opcFX55(WORD opcode); void opcFX65(WORD opcode);
+    WORD fetch(WORD addr) const;
+    instr decode(WORD opcode) const;
+    const instr &lookup(WORD addr);
+    void flush_icache();
+    template <class Q>
+    void run_threaded(int cycles);
+    void invalidate_code(WORD addr);
+
+    /* Idle loop detection
+    Keys and timers only change between run() calls, so within one call a loop that comes
+    back to its start with the same registers, I, timers and stack will keep doing exactly
+    that until the call ends. The engines report every backward jump to idle_skip(). The
+    first report takes a snapshot. If the next one, from the same jump, finds nothing changed,
+    and the loop body has no instruction that could touch memory, the screen, the stack or
+    the random generator, only the whole passes are dropped. A skip over the jump leaves the
+    loop, and code elsewhere can call or return its way back to the jump in the same state,
+    so the pass in between must also have run no 2NNN, 00EE or BNNN and no more instructions
+    than the loop has. The last partial pass still
+    runs, so pc ends where it would have. FX0A waiting with no key down uses up the rest of
+    the call in the same way. This covers JP-to-self, delay timer polling
+    (LD Vx, DT / SE Vx, 0 / JP) and key polling (SKP / JP).
+    */
+    static const int IDLE_BODY = 16; // longest loop, in instructions, that gets checked
+    struct idle_snapshot {
+        WORD target = 0xFFFF; // loop start, 0xFFFF when there is no snapshot
+        WORD from;      // address of the backward jump
+        int remaining;  // cycles left in the run() call when the snapshot was taken
+        BYTE registers [16];
+        WORD I;
+        BYTE delay_timer, sound_timer, sp;
+        uint32_t transfers;
+    } idle;
+    uint32_t transfers = 0; // 2NNN, 00EE and BNNN run so far, so idle_skip() sees a pass leave the loop
+    bool idle_skip_on = true;
+    int idle_skip(WORD from, int remaining);
+    bool idle_body_pure(WORD target, WORD from);
+    // FX0A at its own address again: no key is down, and none will be before run() returns.
+    // 00FD (exit) stays on itself for good and goes through here too.
+    int idle_wait(int remaining) {
+        if (!idle_skip_on)
+            return remaining;
+        skipped_cycles += remaining;
+        return 0;
+    }
+
+    // Where I wraps around: all of memory on XO-CHIP, the first 4 KB everywhere else
+    template <class Q>
+    static constexpr WORD address_mask() { return Q::xochip ? 0xFFFF : 0xFFF; }
+
+    // All writes to memory go through here so stale cache entries get dropped. The caller
+    // wraps addr with address_mask().
+    void write_memory(WORD addr, BYTE value) {
+        memory[addr] = value;
+        if (addr >= CODE_SIZE) {
+            if (addr >= memory_top)
+                memory_top = (addr + 8) & ~(size_t)7;
+            return;
+        }
+        // an instruction starting at addr or at addr-1 includes this byte
+        icache[addr].fn = nullptr;
+        icache[(addr - 1) & 0xFFF].fn = nullptr;
+        if (code_covered && code_covered[addr])
+            invalidate_code(addr);
+    }
+
+    // Skips step over the next instruction, which on XO-CHIP can be the 4 byte F000 NNNN
+    template <class Q>
+    void skip() { pc += (Q::xochip && fetch(pc) == 0xF000) ? 4 : 2; }
+
+    // execute - opcode functions, the templates are the ones with quirks (see quirks.h)
+    void opc0NNN(const instr &op); void opc00E0(const instr &op); void opc00EE(const instr &op); void opc1NNN(const instr &op); void opc2NNN(const instr &op); 
+    template <class Q> void opc3XNN(const instr &op); template <class Q> void opc4XNN(const instr &op); template <class Q> void opc5XY0(const instr &op);
+    void opc6XNN(const instr &op); void opc7XNN(const instr &op);
+    void opc8XY0(const instr &op); template <class Q> void opc8XY1(const instr &op); template <class Q> void opc8XY2(const instr &op);
+    template <class Q> void opc8XY3(const instr &op); void opc8XY4(const instr &op); void opc8XY5(const instr &op); template <class Q> void opc8XY6(const instr &op);
+    void opc8XY7(const instr &op); template <class Q> void opc8XYE(const instr &op); template <class Q> void opc9XY0(const instr &op);
+    void opcANNN(const instr &op); template <class Q> void opcBNNN(const instr &op); void opcCXNN(const instr &op); template <class Q> void opcDXYN(const instr &op);
+    template <class Q> void opcEX9E(const instr &op); template <class Q> void opcEXA1(const instr &op);
+    void opcFX07(const instr &op); void opcFX0A(const instr &op); void opcFX15(const instr &op);
+    void opcFX18(const instr &op); void opcFX1E(const instr &op); void opcFX29(const instr &op); template <class Q> void opcFX33(const instr &op);
+    template <class Q> void opcFX55(const instr &op); template <class Q> void opcFX65(const instr &op);
+    void opc00CN(const instr &op); void opc00FB(const instr &op); void opc00FC(const instr &op); void opc00FD(const instr &op);
+    void opc00FE(const instr &op); void opc00FF(const instr &op); template <class Q> void opcDXY0(const instr &op);
+    void opcFX30(const instr &op); void opcFX75(const instr &op); void opcFX85(const instr &op);
+    void opc00DN(const instr &op); void opc5XY2(const instr &op); void opc5XY3(const instr &op); void opcF000(const instr &op);
+    void opcFN01(const instr &op); void opcF002(const instr &op); void opcFX3A(const instr &op);
+    void opcInvalid(const instr &op);
+
+    // DXYN and DXY0, see opcDXYN()
+    template <class Q, bool HIRES>
+    void draw_sprite(const instr &op, int rows, int width);
+    void set_hires(bool on);
+    uint64_t all_rows() const { return hires ? ~0ull : 0xFFFFFFFFull; } // dirty_rows bits of the whole screen
     
     // Public because emulator needs to access
     public:
-    void init(const std::string &game);
+    chip8();
+    ~chip8();
+    bool init(const std::string &game);
+    bool load(const BYTE *rom, size_t size);
     void reset();
     void cycle();
-    
-    // Timers
-    BYTE delay_timer;
-    BYTE sound_timer;
+    void run(int cycles);
+    void tick_timers();
+    void seed(uint64_t s);
+    uint64_t get_seed() const { return rng_seed; }
+    void set_engine(Engine e);
+    void set_idle_skip(bool on) { idle_skip_on = on; }
+    void set_variant(Variant v);
+    Variant get_variant() const { return variant; }
+    const quirk_flags &get_quirks() const { return quirks; }
+    uint64_t skipped_cycles = 0; // cycles idle loop detection didn't have to run
+    Engine get_engine() const { return engine; }
+    bool same_state(const chip8 &other) const;
+    // The opcode at addr and the kind the engines would decode it as, for tools that read ROMs
+    WORD opcode_at(WORD addr) const { return fetch(addr); }
+    Opcode kind_at(WORD addr) const { return (Opcode)decode(fetch(addr)).kind; }
+    void expand_display(BYTE *out) const;
 
-    // Input
-    BYTE keys [16]; 
-    
-    // Graphics
-    BYTE display [64 * 32]; 
+    // Snapshots, see machine_state
+    const machine_state &state() const { return *this; }
+    // Bytes at the start of state() that can be other than 0, the rest is memory nothing wrote to
+    size_t state_size() const { return offsetof(machine_state, memory) + memory_top; }
+    void save_state(machine_state &out) const;
+    void load_state(const machine_state &in);
+    bool save_state(const std::string &path) const;
+    bool load_state(const std::string &path);
+
+    // The parts of the state the frontend reads and writes directly
+    using machine_state::delay_timer;
+    using machine_state::sound_timer;
+    using machine_state::keys;
+    using machine_state::display;
+    using machine_state::hires;
+    using machine_state::pattern;
+    using machine_state::pitch;
+    using machine_state::pattern_set;
+
+#ifdef CHIP8_PROFILE
+    profiler profile;
+#endif
+    trace_ring trace;
+
+    // Bit y is set when row y changed since the frontend last called take_dirty_rows()
+    uint64_t dirty_rows = ~0ull;
+    uint64_t take_dirty_rows() { uint64_t rows = dirty_rows; dirty_rows = 0; return rows; }
 };
\ No newline at end of file
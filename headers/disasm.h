@@ -0,0 +1,13 @@
+#pragma once
+
+#include "bytes.h"
+
+#include <string>
+
+using namespace bytes;
+
+// One instruction as text, in the usual CHIP-8 assembler syntax (Cowgod's reference), e.g.
+// 0xD015 -> "DRW V0, V1, 5". Opcodes are matched the way chip8::decode() matches them, and
+// anything it treats as invalid comes out as "DW 0x1234". SUPER-CHIP and XO-CHIP opcodes always
+// get their SUPER-CHIP and XO-CHIP names, whichever variant the machine runs.
+std::string disassemble(WORD opcode);
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <SDL2/SDL.h>
+
+// One keypad press or release, stamped with the performance counter when it happened
+struct key_event {
+    Uint64 stamp;
+    BYTE key;
+    bool down;
+};
+
+/* Keypad input
+input lives on the SDL thread. poll() empties the whole event queue every frame. Keypad presses
+and releases are stamped and left in keys for the emulation thread; everything else (hotkeys,
+quit, window events) is left in events for the frontend to handle.
+
+keypad lives on the emulation thread. It queues the changes it is sent and hands them to the
+core through deliver(), which is called between instruction batches, so a change lands in the
+batch that stands for the moment it happened, and a tap shorter than a batch still lasts one.
+The keypad state persists and is written over the core's keys on every delivery, so loading a
+state or rewinding can't leave a key stuck.
+
+Latency is counted from the key event to the first present() of a frame made after the core
+got it. keypad counts its deliveries, and frames carry that count back to input::presented().
+*/
+class input {
+    private:
+    double freq;
+    std::deque<Uint64> sent;    // stamps of changes sent off and not on screen yet, oldest first
+    uint64_t sent_first = 0;    // how many changes were sent before sent.front()
+
+    // Statistics since the last clear_stats()
+    uint64_t changes = 0;
+    uint64_t delivered = 0, base_delivered = 0;
+    double delay = 0, base_delay = 0;           // seconds from the key change to the core
+    double latency_sum = 0, latency_worst = 0;  // seconds from the key change to the screen
+
+    public:
+    std::vector<SDL_Event> events;  // non keypad events from the last poll()
+    std::vector<key_event> keys;    // keypad changes from the last poll()
+
+    input();
+
+    void poll();
+    void presented(Uint64 now, uint64_t delivered, double delivered_delay);
+
+    std::string report() const;
+    void clear_stats();
+};
+
+class keypad {
+    private:
+    std::vector<key_event> queue;   // changes not delivered yet, oldest first
+    bool held [16] = {};            // keypad as the core last saw it
+    double freq;
+
+    public:
+    uint64_t delivered = 0;         // changes handed to the core so far
+    double delivered_delay = 0;     // and the seconds they waited, in total
+
+    keypad();
+
+    void push(const key_event &e) { queue.push_back(e); }
+    void deliver(chip8 &c, Uint64 until);
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <memory>
+#include <vector>
+
+/* Basic-block JIT (x86-64 Linux only)
+Translates a run of instructions starting at pc into native code in an mmap'd executable
+buffer. A block ends at the first jump, call, return, skip, DXYN/DXY0, FX0A or 00FD, after
+FX33/FX55/5XY2 (they may rewrite code) or F000 NNNN (its second half isn't an instruction), or
+after MAX_BLOCK instructions.
+
+Register, timer and I arithmetic is emitted inline and follows the opcXXXX handlers exactly,
+including where VF gets written in 8XY4-8XYE when X or Y is F, and the quirks of the variant
+the machine runs. set_variant() flushes every block. Every other instruction is
+emitted as a direct call to the handler the interpreter would have used, so the JIT never
+needs its own copy of the drawing, stack or key logic.
+
+covered[] counts how many blocks include each byte of memory. chip8::write_memory() checks it
+and calls invalidate() when a write lands on translated code. A block start that keeps getting
+invalidated is code the ROM rewrites on every pass, so after SMC_LIMIT invalidations it is left
+to the interpreter instead of being recompiled each time. When fewer cycles are left than
+a block contains, the last few instructions run on the interpreter so cycle counts stay exact.
+Blocks that end in a backward jump, FX0A or 00FD go through the same idle loop checks as the
+other engines when they return.
+*/
+class jit {
+    private:
+    typedef void (*block_fn)(chip8 *c);
+
+    struct block {
+        block_fn code;
+        WORD start;     // address of the first instruction
+        WORD bytes;     // bytes of CHIP-8 code covered
+        int count;      // instructions in the block
+        WORD last;      // address of the last instruction
+        BYTE last_kind; // and its Opcode, for the idle loop checks after the block
+        std::vector<chip8::instr> ops; // decoded copies for the handler calls, must not move
+    };
+
+    static const int MAX_BLOCK = 64;
+    static const int SMC_LIMIT = 4;
+    static const size_t BUFFER_SIZE = 4 << 20;
+
+    chip8 &c;
+    BYTE *buffer = nullptr;
+    size_t used = 0;
+    block *entry [CODE_SIZE] = {}; // block that starts at each address
+    BYTE rewrites [CODE_SIZE] = {}; // times the block starting at each address was invalidated
+    std::vector<std::unique_ptr<block>> blocks;
+
+    block *compile(WORD addr);
+    void drop(block *b);
+
+    public:
+    explicit jit(chip8 &owner);
+    ~jit();
+
+    void run(int cycles);
+    void invalidate(WORD addr);
+    void flush();
+    bool ok() const { return buffer != nullptr; }
+
+    BYTE covered [CODE_SIZE] = {};
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "bytes.h"
+#include "quirks.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace bytes;
+
+const uint64_t FNV_OFFSET = 14695981039346656037ull;
+const uint64_t FNV_PRIME = 1099511628211ull;
+
+// FNV-1a, pass the last result back in to hash several pieces as one
+inline uint64_t fnv1a(const BYTE *data, size_t size, uint64_t hash = FNV_OFFSET) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/* ROM files
+rom_file maps a ROM read only (mmap, or a file mapping on Windows) so loading and hashing it
+never copies it through a buffer. Where mapping fails, or for an empty file, it reads the file
+into memory instead. The bytes stay valid until close() or the rom_file goes away.
+*/
+class rom_file {
+    private:
+    const BYTE *bytes = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    std::vector<BYTE> copy; // when the file couldn't be mapped
+
+    public:
+    rom_file() = default;
+    rom_file(const rom_file &) = delete;
+    rom_file &operator=(const rom_file &) = delete;
+    ~rom_file() { close(); }
+
+    bool open(const std::string &path);
+    void close();
+
+    const BYTE *data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+/* ROM library
+Every ROM under game-roms/ and test-roms/, plus anything listed in config.txt, with a hash of
+its contents and the quirk profile it runs with. The list is kept in library.idx, one tab
+separated line per ROM, so a file is only read again when its size or modification time
+changed. The profile is tied to the hash, so a ROM keeps it when it is renamed or moved, and
+editing the profile column in the index is how a ROM gets a different one.
+*/
+const char *const LIBRARY_INDEX = "library.idx";
+const char *const LIBRARY_CONFIG = "config.txt";
+const char *const LIBRARY_DIRS[] = {"game-roms", "test-roms"};
+
+struct rom_entry {
+    std::string path;
+    std::string name;       // file name without its folder and extension
+    std::string profile;    // quirk profile, guessed from the extension until edited
+    uint64_t hash;          // FNV-1a of the whole file
+    uint64_t size;
+    int64_t mtime;          // as the file system reports it, only ever compared
+};
+
+class rom_library {
+    private:
+    std::vector<rom_entry> entries; // sorted by path
+    std::string index_path;
+    bool changed = false;
+
+    rom_entry *lookup(const std::string &path);
+    const rom_entry *add(const std::string &path);
+
+    public:
+    // Reads the index at `path` (a missing one is an empty library) and keeps the path for save()
+    bool open(const std::string &path = LIBRARY_INDEX);
+    // Brings the library up to date with the folders and config.txt. Returns how many ROMs had
+    // to be hashed.
+    int scan();
+    // Writes the index back, if anything changed
+    bool save();
+
+    // A ROM by path (added to the library if it isn't in it yet), by its number in roms(), by
+    // the start of its hash, or by part of its name. Empty with a reason in `error` unless
+    // exactly one ROM matches.
+    const rom_entry *find(const std::string &query, std::string &error);
+    const rom_entry *by_hash(uint64_t hash) const;
+
+    const std::vector<rom_entry> &roms() const { return entries; }
+    std::string list() const;
+};
+
+std::string hash_string(uint64_t hash);
+// The variant named in the profile column, VARIANT_DEFAULT (with a warning) for a name it doesn't know
+Variant rom_variant(const rom_entry &e);
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+/* Lock-free channels between two threads
+spsc_queue is a bounded ring for one producer and one consumer. push() and pop() each touch
+one atomic the other side writes and never wait, they just report a full or empty ring.
+
+triple_buffer hands whole values from a writer to a reader that only cares about the newest
+one. The writer fills its back buffer and publish() swaps it with the middle one, the reader's
+update() swaps its front buffer with the middle one if something new was published. Neither
+side ever waits for the other, and the reader always sees a complete value.
+*/
+template <typename T, size_t N>
+class spsc_queue {
+    private:
+    static_assert((N & (N - 1)) == 0, "spsc_queue size must be a power of two");
+
+    T items [N];
+    alignas(64) std::atomic<size_t> head{0}; // next item to pop, written by the consumer
+    alignas(64) std::atomic<size_t> tail{0}; // next slot to push, written by the producer
+
+    public:
+    bool push(const T &item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N)
+            return false;
+        items[t & (N - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        item = items[h & (N - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+template <typename T>
+class triple_buffer {
+    private:
+    static const int FRESH = 4; // set in middle when the writer published since the last update()
+
+    T buffers [3];
+    alignas(64) std::atomic<int> middle{1};
+    alignas(64) int back = 0;   // writer's
+    alignas(64) int front = 2;  // reader's
+
+    public:
+    // The buffer being written holds whatever was published two rounds ago, fill all of it
+    T &write_buffer() { return buffers[back]; }
+    void publish() { back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & 3; }
+
+    bool update() {
+        if (!(middle.load(std::memory_order_relaxed) & FRESH))
+            return false;
+        front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+        return true;
+    }
+    const T &read_buffer() const { return buffers[front]; }
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Input movies
+A movie is everything needed to play a session back exactly: the random seed, a hash of
+memory right after the ROM was loaded, and the keypad. The keypad is stored as changes at
+exact cycle offsets inside each frame, where a frame is one 60 Hz timer tick of ips/60
+instructions, so playback gives the same machine at every frame whatever the engine, the
+host speed or the idle skipping.
+
+Frames are cut by the same fractional schedule the frontend uses, so the frame sizes are not
+stored. The body is a byte stream of ops with variable length numbers:
+    QUIET n             n frames without key changes
+    KEYS k (d m) * k    one frame with k changes, each d cycles after the last one, to mask m
+    IPS n               the schedule runs at n instructions per second from the next frame
+    CYCLES n            the next frame runs n cycles instead of what the schedule says
+A minute without input is a few bytes.
+*/
+const char MOVIE_MAGIC[4] = {'C', '8', 'M', 'V'};
+const uint32_t MOVIE_VERSION = 2; // 2 added the variant, 1 is still read as VARIANT_DEFAULT
+
+struct movie_header {
+    char magic[4];
+    uint32_t version;
+    uint64_t seed;
+    uint64_t image_hash;    // FNV-1a of memory after load(), see image_hash()
+    uint32_t ips;           // schedule at the first frame
+    uint32_t frames;
+    uint32_t size;          // bytes of ops after the header
+    uint32_t variant;       // quirks the session ran with, padding left undefined in version 1
+};
+
+class movie {
+    private:
+    enum Op {OP_QUIET=0, OP_KEYS, OP_IPS, OP_CYCLES};
+
+    movie_header header;
+    std::vector<BYTE> ops;
+
+    // Shared by recording and playback
+    int ips = 0;
+    double cycles_due = 0;
+    int scheduled_cycles();
+
+    // Recording
+    uint32_t quiet = 0;     // frames without changes not written out yet
+    int expected = 0;       // what the schedule says the frame being recorded runs
+    std::vector<uint32_t> frame_changes; // offset << 16 | mask, for the frame being recorded
+    WORD recorded_keys = 0;
+    void put(uint32_t value);
+    void flush_quiet();
+
+    // Playback
+    size_t cursor = 0;
+    uint32_t played = 0;
+    uint32_t quiet_left = 0;
+    WORD keys = 0;
+    bool get(uint32_t &value);
+
+    public:
+    static uint64_t image_hash(const chip8 &c);
+
+    // Recording: record() right after load(), then per frame begin_frame(), keys_at() whenever
+    // the keypad may have changed, and end_frame() once its cycles ran
+    void record(const chip8 &c, int ips);
+    void begin_frame(int ips);
+    void keys_at(int offset, const BYTE *pad);
+    void end_frame(int cycles);
+    bool save(const std::string &path);
+
+    // Playback: load(), then start() on a chip8 that has the right ROM, then play_frame().
+    // start() switches the machine to the recorded variant.
+    bool load(const std::string &path);
+    bool start(chip8 &c);
+    bool play_frame(chip8 &c);
+    bool finished() const { return played >= header.frames; }
+
+    uint32_t frames() const { return header.frames; }
+    uint32_t frame() const { return played; }
+    uint64_t seed() const { return header.seed; }
+    int start_ips() const { return header.ips; }
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include <SDL2/SDL.h>
+
+/* Frame pacer
+Holds the main loop to an exact frame rate on the high resolution clock. Deadlines are
+absolute, start + n * period, so rounding never adds up and the average is the requested rate
+to the last tick of the counter. Waiting sleeps in SDL_WaitEventTimeout (which also wakes up
+on input) until shortly before the deadline, then spins the rest. The spin margin follows how
+late the sleeps actually wake up on this machine, so it stays as short as the OS allows.
+
+If the loop falls more than a whole frame behind (window drag, breakpoint) the schedule starts
+over from now instead of rushing through the missed frames.
+*/
+class pacer {
+    private:
+    double freq;            // counter ticks per second
+    double period;          // counter ticks per frame
+    double margin;          // seconds before the deadline where sleeping stops and spinning starts
+    Uint64 start = 0;       // counter at frame 0 of the current schedule
+    uint64_t frame = 0;     // frames since start
+    Uint64 last_wake = 0;
+
+    // Jitter statistics since the last clear_stats()
+    uint64_t frames = 0;
+    uint64_t missed = 0;    // schedule restarts
+    double period_sum = 0, period_squares = 0; // seconds between wake ups
+    double late_sum = 0, late_worst = 0;       // seconds past the deadline at wake up
+
+    void sleep_until(Uint64 deadline);
+    void record(Uint64 now, Uint64 deadline);
+
+    public:
+    explicit pacer(double hz);
+
+    void wait();
+    void restart();
+
+    std::string report() const;
+    void clear_stats();
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "bytes.h"
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+using namespace bytes;
+
+/* Execution profiler
+Only built with -DCHIP8_PROFILE. chip8 then owns one of these, and both the interpreter and
+the threaded engine count every instruction by opcode family and by address (the JIT is
+turned off in profiling builds, it would skip the counters). Time spent decoding, and in the
+frontend's input and rendering code, is added up with profile_timer. Each thread counts into
+a profiler of its own, merge() adds them up for the report.
+
+report() turns the counters into a hot-spot listing, with one line per address and a
+disassembly of each, plus the hottest loops found by looking for backward jumps.
+*/
+enum Section {PROF_EMULATE=0, PROF_DECODE, PROF_INPUT, PROF_RENDER, PROF_SECTIONS};
+
+class profiler {
+    public:
+    static const int KINDS = 64; // room for every Opcode, checked in profiler.cpp
+
+    uint64_t opcodes [KINDS] = {};
+    uint64_t pcs [4096] = {};
+    double seconds [PROF_SECTIONS] = {};
+
+    void count(WORD pc, BYTE kind) {
+        opcodes[kind]++;
+        pcs[pc & 0xFFF]++;
+    }
+    void clear();
+    void merge(const profiler &other);
+    std::string report(const BYTE *memory) const;
+};
+
+// Adds the time until the end of the enclosing scope to one section
+class profile_timer {
+    private:
+    profiler &p;
+    Section section;
+    std::chrono::steady_clock::time_point start;
+
+    public:
+    profile_timer(profiler &owner, Section s) : p(owner), section(s), start(std::chrono::steady_clock::now()) {}
+    ~profile_timer() { p.seconds[section] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); }
+};
+
+#ifdef CHIP8_PROFILE
+#define PROFILE_COUNT(p, pc, kind)  (p).count(pc, kind)
+#define PROFILE_SCOPE(p, section)   profile_timer profile_scope_##section(p, section)
+#else
+#define PROFILE_COUNT(p, pc, kind)
+#define PROFILE_SCOPE(p, section)
+#endif
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <string>
+
+/* Quirks
+The CHIP-8 interpreters ROMs were written for disagree on a handful of instructions. Each
+variant below is a policy struct of compile-time constants, and the handlers that care are
+templates on it. chip8 builds one handler table and one threaded engine per variant, and
+set_variant() only swaps which ones the cache decodes into, so a running ROM never tests a
+quirk: the other side of every `if (Q::...)` was compiled out of its handlers.
+
+    vf_reset    8XY1, 8XY2 and 8XY3 clear VF afterwards
+    index       how far FX55 and FX65 move I: past the last register, to it, or not at all
+    shift_vy    8XY6 and 8XYE shift VY into VX instead of shifting VX in place
+    jump_vx     BNNN is BXNN and jumps to XNN + VX instead of NNN + V0
+    clip        DXYN cuts sprites off at the edges of the screen instead of wrapping them
+    schip       the SUPER-CHIP instructions decode: 128x64 mode, scrolling, 16x16 sprites, the
+                big font and the RPL flags. Without it they stay 0NNN, DXYN or invalid as before.
+    xochip      the XO-CHIP instructions decode too (bit planes, F000 NNNN, audio patterns,
+                5XY2/5XY3, 00DN), I reaches all 64 KB of memory instead of wrapping at 4 KB,
+                and skips step over all four bytes of an F000 NNNN
+
+VARIANT_DEFAULT is how this emulator always behaved, and what ROMs run with until the ROM
+library says otherwise.
+*/
+enum Variant {VARIANT_DEFAULT=0, VARIANT_VIP, VARIANT_CHIP48, VARIANT_SCHIP, VARIANT_XOCHIP, VARIANTS};
+
+enum IndexQuirk {INDEX_PAST=0, INDEX_LAST, INDEX_KEEP};
+
+struct quirks_default {
+    static constexpr bool vf_reset = false;
+    static constexpr IndexQuirk index = INDEX_PAST;
+    static constexpr bool shift_vy = false;
+    static constexpr bool jump_vx = false;
+    static constexpr bool clip = false;
+    static constexpr bool schip = false;
+    static constexpr bool xochip = false;
+};
+
+// COSMAC VIP, the original interpreter
+struct quirks_vip {
+    static constexpr bool vf_reset = true;
+    static constexpr IndexQuirk index = INDEX_PAST;
+    static constexpr bool shift_vy = true;
+    static constexpr bool jump_vx = false;
+    static constexpr bool clip = true;
+    static constexpr bool schip = false;
+    static constexpr bool xochip = false;
+};
+
+// CHIP-48 on the HP-48, which stopped one short when moving I
+struct quirks_chip48 {
+    static constexpr bool vf_reset = false;
+    static constexpr IndexQuirk index = INDEX_LAST;
+    static constexpr bool shift_vy = false;
+    static constexpr bool jump_vx = true;
+    static constexpr bool clip = true;
+    static constexpr bool schip = false;
+    static constexpr bool xochip = false;
+};
+
+// SUPER-CHIP 1.1
+struct quirks_schip {
+    static constexpr bool vf_reset = false;
+    static constexpr IndexQuirk index = INDEX_KEEP;
+    static constexpr bool shift_vy = false;
+    static constexpr bool jump_vx = true;
+    static constexpr bool clip = true;
+    static constexpr bool schip = true;
+    static constexpr bool xochip = false;
+};
+
+// XO-CHIP went back to the VIP for everything but VF and the screen edges
+struct quirks_xochip {
+    static constexpr bool vf_reset = false;
+    static constexpr IndexQuirk index = INDEX_PAST;
+    static constexpr bool shift_vy = true;
+    static constexpr bool jump_vx = false;
+    static constexpr bool clip = false;
+    static constexpr bool schip = true;
+    static constexpr bool xochip = true;
+};
+
+// The same quirks as plain values, for the JIT, which reads them once when it translates a
+// block rather than on every instruction
+struct quirk_flags {
+    bool vf_reset;
+    IndexQuirk index;
+    bool shift_vy;
+    bool jump_vx;
+    bool clip;
+    bool schip;
+    bool xochip;
+};
+
+template <class Q>
+constexpr quirk_flags flags_of() { return {Q::vf_reset, Q::index, Q::shift_vy, Q::jump_vx, Q::clip, Q::schip, Q::xochip}; }
+
+const char *variant_name(Variant v);
+bool parse_variant(const std::string &name, Variant &v);
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "bytes.h"
+
+#include <cstdint>
+#include <string>
+
+#include <SDL2/SDL.h>
+
+using namespace bytes;
+
+/* Streaming texture renderer
+Keeps the screen in one 128x64 streaming texture that SDL stretches to the window, instead of
+drawing thousands of scaled points every frame. 64x32 screens and the text screens fill it
+with 2x2 pixels, so switching to the SUPER-CHIP mode and back never recreates the texture.
+Only rows flagged dirty by the core are converted and uploaded, and present() does nothing on
+frames where no row changed.
+
+The core keeps one bit packed screen per XO-CHIP plane. A pixel's colour is its bits from
+every plane put together as an index into PALETTE. spread[] turns one byte of a plane into
+8 pixels a nibble each, so 8 pixels of all four planes combine with three shifts and ORs
+instead of 32 bit tests. With only the first plane in use that is black and white as ever.
+*/
+class renderer {
+    private:
+    static const int WIDTH = 128;
+    static const int HEIGHT = 64;
+
+    SDL_Renderer *sdl = nullptr;
+    SDL_Texture *texture = nullptr;
+    Uint32 pixels [WIDTH * HEIGHT];
+    uint64_t forced_rows = ~0ull; // rows to upload next draw() no matter what the core says
+    const std::string *overlay = nullptr; // text screen currently in the texture, if any
+    bool hires = false; // mode of the screen in the texture
+    bool changed = true;
+    uint32_t spread [256]; // pixel i from the left (bit 7-i of the byte) becomes bit 4*i
+
+    void upload_rows(int first, int last);
+
+    public:
+    ~renderer();
+    bool init(SDL_Renderer *r);
+
+    // display and dirty_rows as chip8 has them, rows counted in the mode's own pixels
+    void draw(const uint64_t (*display)[64][2], bool hires, uint64_t dirty_rows);
+    void draw(const std::string &screen);
+    void invalidate();
+    void present();
+};
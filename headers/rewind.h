@@ -0,0 +1,57 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <vector>
+#include <cstdint>
+
+/* Rewind buffer
+Remembers the last few minutes of machine states, one per emulated frame. Only the start of a
+state that chip8::state_size() says can be other than 0 is looked at, about 8 KB unless an
+XO-CHIP ROM uses memory past the first 4 KB. Every KEYFRAME_INTERVAL-th frame is kept whole
+in its own ring of keyframes. All the frames after it are stored as the XOR of the state
+against that keyframe, run length encoded a 64-bit word at a time, so a frame that only
+touched a few registers and display rows costs a few hundred bytes. The deltas share one fixed
+arena used as a ring, and the oldest frames are dropped when it fills up.
+
+With the defaults that is a 4 MB arena and 300 keyframes, about 7 MB in all for a ROM that
+stays in 4 KB. Each keyframe grows with the memory an XO-CHIP ROM reaches, up to 68 KB, so one
+that fills all 64 KB takes about 25 MB.
+
+push() is one pass over the 64-bit words of the state and allocates nothing once every keyframe
+is as big as the states put in it. step_back() decodes a single delta on top of its keyframe,
+so rewinding costs about the same as recording.
+*/
+class rewind_buffer {
+    private:
+    static const int KEYFRAME_INTERVAL = 60;
+    static const size_t WORDS = sizeof(machine_state) / 8; // the most a state can have
+
+    struct frame {
+        size_t offset;  // start of the delta in the arena
+        size_t length;  // bytes of delta, 0 for the keyframes themselves
+    };
+
+    std::vector<frame> frames;      // ring, one slot per frame
+    // keyframes[i / KEYFRAME_INTERVAL] belongs to frames[i], the start of a state, the rest is 0
+    std::vector<std::vector<BYTE>> keyframes;
+    std::vector<BYTE> arena;        // ring of encoded deltas
+    std::vector<BYTE> scratch;      // worst case encoding of one frame
+    size_t head = 0;    // slot of the newest frame
+    size_t count = 0;   // frames that can still be restored
+    size_t cursor = 0;  // next free byte in the arena
+
+    size_t encode(const BYTE *s, const BYTE *key, size_t words);
+    void decode(size_t slot, machine_state &out) const;
+    bool overlaps(const frame &f, size_t offset, size_t length) const;
+
+    public:
+    explicit rewind_buffer(int seconds = 300, size_t arena_bytes = 4 << 20);
+
+    void push(const machine_state &s, size_t size = sizeof(machine_state));
+    bool step_back(machine_state &out);
+    void clear() { count = 0; cursor = 0; }
+
+    size_t size() const { return count; }
+    size_t memory_used() const;
+};
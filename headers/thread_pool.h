@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Work-stealing thread pool
+Every worker owns a deque of jobs. A worker pops jobs from the front of its own
+deque and, once that runs dry, steals from the back of the other workers' deques,
+so a worker that drew short ROMs keeps busy on someone else's long ones.
+Jobs are submitted round robin across the workers.
+*/
+class thread_pool {
+    private:
+    struct worker_queue {
+        std::mutex lock;
+        std::deque<std::function<void()>> jobs;
+    };
+
+    std::vector<std::unique_ptr<worker_queue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex idle_lock;
+    std::condition_variable work_ready;
+    std::condition_variable all_done;
+    size_t pending = 0; // jobs submitted but not finished, guarded by idle_lock
+    // Jobs sitting in a deque, only raised while holding idle_lock. Dips below 0 for a moment
+    // when a worker takes a job before submit() has counted it.
+    std::atomic<ptrdiff_t> queued{0};
+    size_t next_queue = 0;
+    bool stopping = false;
+
+    bool pop_local(size_t id, std::function<void()> &job);
+    bool steal(size_t id, std::function<void()> &job);
+    void worker_loop(size_t id);
+
+    public:
+    explicit thread_pool(size_t threads = std::thread::hardware_concurrency());
+    ~thread_pool();
+
+    void submit(std::function<void()> job);
+    void wait();
+    size_t size() const { return workers.size(); }
+
+    // Jobs taken from another worker's deque, handy to see whether stealing kicks in
+    std::atomic<size_t> steals{0};
+};
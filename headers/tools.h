@@ -0,0 +1,19 @@
+#pragma once
+
+#include "chip8.h"
+
+#include <string>
+#include <vector>
+
+// Helpers shared by the command line tools (headless, bench, conform), none of them need SDL
+
+// Turns the ROMs given on the command line (paths, numbers, hashes or names, see rom_library::find)
+// into paths, and the variant the library has for each. With none given, every ROM in the library.
+bool resolve_roms(std::vector<std::string> &roms, std::vector<Variant> &variants);
+bool read_rom(const std::string &path, std::vector<BYTE> &rom);
+
+const char *engine_name(Engine e);
+bool parse_engine(const std::string &name, Engine &e);
+
+// FNV-1a over the screen the current mode shows, the same for every engine and host
+uint64_t display_hash(const chip8 &c);
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "bytes.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace bytes;
+
+/* Trace log
+The core reports trouble (invalid opcodes, stack under and overflow, memory accesses past
+4 KB, ROM loading) as fixed size binary records in a ring that belongs to each chip8. Nothing
+is formatted or printed while the machine runs. A record identical to the newest one bumps its
+repeat count instead of taking a new slot, so a ROM stuck on a bad opcode costs one record and
+the ring keeps the history before it.
+
+Levels can be changed at any time. Below the current level, TRACE() is a single compare. The
+ring is written only by the thread that runs the machine, with no locks. save() writes it to
+a file and the tracedump tool turns that file back into text.
+*/
+enum TraceLevel {TRACE_OFF=0, TRACE_ERROR, TRACE_WARN, TRACE_INFO, TRACE_LEVELS};
+
+enum TraceEvent {
+    TR_INVALID_OPCODE=0,    // a = opcode
+    TR_STACK_UNDERFLOW,     // return with nothing on the stack
+    TR_STACK_OVERFLOW,      // a = call target, the 17th call overwrote the oldest return address
+    TR_MEMORY_RANGE,        // a = I, b = bytes accessed, wrapped around to address 0
+    TR_ROM_LOADED,          // a = size
+    TR_ROM_FAILED,          // a = size, b = LoadError
+    TR_EVENTS
+};
+
+// LOAD_SHORT_READ is only in traces saved before ROMs were mapped, it stays so they still decode
+enum LoadError {LOAD_OPEN=0, LOAD_TOO_LARGE, LOAD_SHORT_READ};
+
+struct trace_record {
+    uint32_t seq;       // records logged before this one, gaps mean the ring wrapped
+    uint32_t repeat;    // further times the same thing happened right after
+    BYTE event;
+    BYTE level;
+    WORD pc;            // address of the instruction, 0 for records from outside execution
+    WORD a, b;
+};
+static_assert(sizeof(trace_record) == 16, "trace_record is written to files as is");
+
+const char TRACE_MAGIC[4] = {'C', '8', 'T', 'R'};
+const uint32_t TRACE_VERSION = 1;
+
+class trace_ring {
+    private:
+    static const int SIZE = 256;
+    trace_record ring [SIZE];
+    uint32_t logged = 0;
+
+    public:
+    int level = TRACE_WARN;
+
+    void log(int level, int event, WORD pc, WORD a = 0, WORD b = 0);
+    std::vector<trace_record> records() const;
+    void clear() { logged = 0; }
+
+    bool save(const std::string &path) const;
+    static bool load(const std::string &path, std::vector<trace_record> &out);
+};
+
+#define TRACE(ring, lvl, ...) do { if ((lvl) <= (ring).level) (ring).log((lvl), __VA_ARGS__); } while (0)
+
+const char *trace_level_name(int level);
+bool parse_trace_level(const std::string &name, int &level);
+std::string describe(const trace_record &r);
@@ -0,0 +1,80 @@
+#include "../headers/aot.h"
+
+// Function-local, so generated files can register from their static initializers in any order
+static std::vector<const aot_program *> &registry() {
+    static std::vector<const aot_program *> programs;
+    return programs;
+}
+
+aot_registration::aot_registration(const aot_program &p) {
+    registry().push_back(&p);
+}
+
+const std::vector<const aot_program *> &aot_programs() {
+    return registry();
+}
+
+const aot_program *aot_find(uint64_t hash, Variant v) {
+    for (const aot_program *p : registry())
+        if (p->hash == hash && p->variant == v)
+            return p;
+    return nullptr;
+}
+
+// Picks the translation of the loaded ROM for the variant the machine runs, and marks the
+// blocks whose code still matches what it was translated from. The ROM is found by the hash
+// load() took of the file, memory may have been written over since. Called from load(),
+// set_variant(), set_engine() and load_state(), so rewrites made before any of them are seen too.
+void aot::bind() {
+    memset(covered, 0, sizeof(covered));
+    memset(block_at, 0xFF, sizeof(block_at));
+    live.clear();
+    program = aot_find(c.rom_hash, c.variant);
+    if (program == nullptr)
+        return;
+    live.assign(program->count, 0);
+    for (int i = 0; i < program->count; i++) {
+        const aot_block &b = program->blocks[i];
+        block_at[b.start] = i;
+        if (b.start + b.bytes > program->image_size || memcmp(&c.memory[b.start], &program->image[b.start], b.bytes) != 0)
+            continue;
+        live[i] = 1;
+        for (int j = 0; j < b.bytes; j++)
+            covered[b.start + j]++;
+    }
+}
+
+// A write landed on translated code. Its blocks stay dead until the next bind(): the code
+// that was translated is gone, whatever the ROM writes there later.
+void aot::invalidate(WORD addr) {
+    for (int i = 0; i < program->count; i++) {
+        const aot_block &b = program->blocks[i];
+        if (!live[i] || addr < b.start || addr >= b.start + b.bytes)
+            continue;
+        live[i] = 0;
+        for (int j = 0; j < b.bytes; j++)
+            covered[b.start + j]--;
+    }
+}
+
+void aot::run(int cycles) {
+    if (program == nullptr) {
+        (c.*c.threaded)(cycles);
+        return;
+    }
+    while (cycles > 0) {
+        cycles = program->run(c, live.data(), cycles);
+        if (cycles <= 0)
+            break;
+        // The block at pc needs more cycles than the frame has left, which happens every frame
+        // at low speeds: finish it on the threaded engine rather than one cycle() at a time
+        int i = c.pc < CODE_SIZE ? block_at[c.pc] : -1;
+        if (i >= 0 && live[i]) {
+            (c.*c.threaded)(cycles);
+            return;
+        }
+        // pc is where no live block starts
+        c.cycle();
+        cycles--;
+    }
+}
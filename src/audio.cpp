@@ -0,0 +1,75 @@
+#include "../headers/audio.h"
+
+#include <cmath>
+
+const int SAMPLE_RATE = 48000;
+const int BUFFER_SAMPLES = 512;     // about 11 ms, under a 60 Hz frame
+const double TONE_HZ = 440;
+const float VOLUME = 0.2f;
+const float RAMP_SECONDS = 0.002f;
+
+audio::~audio() {
+    if (device)
+        SDL_CloseAudioDevice(device);
+}
+
+bool audio::init() {
+    SDL_AudioSpec want = {}, have;
+    want.freq = SAMPLE_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 1;
+    want.samples = BUFFER_SAMPLES;
+    want.callback = callback;
+    want.userdata = this;
+    device = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+    if (!device)
+        return false;
+    rate = have.freq;
+    step = TONE_HZ / have.freq;
+    ramp = 1.0f / (RAMP_SECONDS * have.freq);
+    SDL_PauseAudioDevice(device, 0);
+    return true;
+}
+
+// Emulation thread. False if the ring is full, the caller tries again with its next batch.
+bool audio::set(const tone &t) {
+    return !device || changes.push(t);
+}
+
+void audio::callback(void *self, Uint8 *stream, int len) {
+    audio *a = (audio *)self;
+    tone t;
+    while (a->changes.pop(t)) {
+        // The wave carries on from where it was, only a new kind of wave starts over
+        if (t.pattern_set != a->playing.pattern_set)
+            a->phase = 0;
+        a->playing = t;
+    }
+    // XO-CHIP: 4000 * 2^((pitch - 64) / 48) bits per second
+    a->pattern_step = 4000 * std::pow(2.0, (a->playing.pitch - 64) / 48.0) / a->rate;
+    a->fill((Sint16 *)stream, len / sizeof(Sint16));
+}
+
+void audio::fill(Sint16 *out, int samples) {
+    float target = playing.on ? VOLUME : 0;
+    for (int i = 0; i < samples; i++) {
+        if (level < target)
+            level = level + ramp < target ? level + ramp : target;
+        else if (level > target)
+            level = level - ramp > target ? level - ramp : target;
+        float wave;
+        if (playing.pattern_set) {
+            int bit = (int)phase;
+            wave = ((playing.pattern[bit / 8] >> (7 - bit % 8)) & 1) ? level : -level;
+            phase += pattern_step;
+            if (phase >= 128)
+                phase -= 128;
+        } else {
+            phase += step;
+            if (phase >= 1)
+                phase -= 1;
+            wave = phase < 0.5 ? level : -level;
+        }
+        out[i] = (Sint16)(wave * 32767);
+    }
+}
@@ -0,0 +1,316 @@
+#include "../headers/chip8.h"
+#include "../headers/tools.h"
+
+#include <iostream>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <climits>
+#include <functional>
+#include <algorithm>
+#include <memory>
+
+/* Benchmarks for the core
+Micro benchmarks build a tiny ROM for each case: a few setup instructions, then the
+instruction under test repeated 1024 times and a jump back. The whole loop runs for a fixed
+number of cycles, so ns/op is handler plus dispatch. 0NNN does nothing and gives the cost of
+dispatch on its own. The decode case compares the first run over 1024 fresh instructions
+after load() with a second, cached run; on the jit engine that difference is translation.
+
+Macro benchmarks run each ROM for a number of emulated seconds (60 frames a second, each
+--cpf cycles and one timer tick) and report instructions and frames per wall clock second.
+
+Every number is the best of --repeat runs. The result is a single JSON object on stdout (or
+in the -o file) so two builds can be diffed or graphed.
+
+Usage: bench [options] [rom ...]
+    -e, --engine NAME   interpreter, threaded, jit or aot (default: threaded where supported)
+    --seconds N         emulated seconds per ROM in the macro run (default 3600)
+    --cpf N             cycles per frame for the macro run (default 11)
+    --cycles N          cycles per micro case (default 4000000)
+    --repeat N          runs per measurement, the fastest counts (default 5)
+    --no-micro          skip the micro benchmarks
+    --no-macro          skip the ROMs
+    -o, --output FILE   write the JSON there instead of stdout
+ROMs can be paths, numbers, hashes or names from the ROM library, with none given every
+ROM in it is used.
+*/
+
+typedef std::chrono::steady_clock bench_clock;
+
+const WORD LOOP_START = 0x220;  // setup goes before this, the repeated body after
+const WORD SUBROUTINE = 0xE00;  // 00EE for the call/return case
+const WORD SPRITE_DATA = 0xF00; // I points here, 16 bytes of sprite
+const int BODY_COPIES = 1024;
+
+struct options {
+    Engine engine = CHIP8_HAS_THREADED ? ENGINE_THREADED : ENGINE_INTERPRETER;
+    int seconds = 3600;
+    int cpf = 700/60;
+    long long cycles = 4000000;
+    int repeat = 5;
+    bool micro = true;
+    bool macro = true;
+    std::string output;
+    std::vector<std::string> roms;
+    std::vector<Variant> variants; // from the ROM library, one per ROM
+};
+
+struct micro_case {
+    std::string name;
+    std::vector<WORD> setup;                // runs once, before LOOP_START
+    std::function<WORD(WORD addr)> body;    // instruction to place at addr
+};
+
+void usage() {
+    std::cerr << "Usage: bench [-e engine] [--seconds N] [--cpf N] [--cycles N] [--repeat N] [--no-micro] [--no-macro] [-o file] [rom ...]\n";
+}
+
+bool parse_args(int argc, char **argv, options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if ((arg == "-e" || arg == "--engine") && has_value) {
+            std::string name = argv[++i];
+            if (!parse_engine(name, opt.engine)) {
+                std::cerr << "Error: unknown engine " << name << "\n";
+                return false;
+            }
+        }
+        else if (arg == "--seconds" && has_value)                   opt.seconds = std::stoi(argv[++i]);
+        else if (arg == "--cpf" && has_value)                       opt.cpf = std::stoi(argv[++i]);
+        else if (arg == "--cycles" && has_value)                    opt.cycles = std::stoll(argv[++i]);
+        else if (arg == "--repeat" && has_value)                    opt.repeat = std::stoi(argv[++i]);
+        else if (arg == "--no-micro")                               opt.micro = false;
+        else if (arg == "--no-macro")                               opt.macro = false;
+        else if ((arg == "-o" || arg == "--output") && has_value)   opt.output = argv[++i];
+        else if (arg == "-h" || arg == "--help")                    return false;
+        else if (!arg.empty() && arg[0] == '-') {
+            std::cerr << "Error: unknown option " << arg << "\n";
+            return false;
+        }
+        else opt.roms.push_back(arg);
+    }
+    return opt.seconds > 0 && opt.cpf > 0 && opt.cycles > 0 && opt.repeat > 0;
+}
+
+// Lays out setup, BODY_COPIES of the body and the jump back as a ROM image starting at 0x200
+std::vector<BYTE> build_rom(const micro_case &mc) {
+    std::vector<BYTE> rom(0x1000 - 0x200, 0);
+    auto put = [&](WORD addr, WORD opcode) {
+        rom[addr - 0x200] = opcode >> 8;
+        rom[addr - 0x200 + 1] = opcode & 0xFF;
+    };
+    WORD addr = 0x200;
+    for (WORD opcode : mc.setup) {
+        put(addr, opcode);
+        addr += 2;
+    }
+    put(addr, 0x1000 | LOOP_START);
+    for (addr = LOOP_START; addr < LOOP_START + 2 * BODY_COPIES; addr += 2)
+        put(addr, mc.body(addr));
+    put(addr, 0x1000 | LOOP_START);
+    put(SUBROUTINE, 0x00EE);
+    for (int i = 0; i < 16; i++)
+        rom[SPRITE_DATA - 0x200 + i] = (i & 1) ? 0xA5 : 0xFF;
+    return rom;
+}
+
+std::vector<micro_case> micro_cases() {
+    // V0-V3 = 0, I = SPRITE_DATA. Most cases just repeat one opcode, skips are picked so they
+    // don't skip (EXA1 can't be, no key is ever down) and jumps go to the next instruction.
+    const std::vector<WORD> base = {0x6000, 0x6100, 0x6200, 0x6300, 0xA000 | SPRITE_DATA};
+    auto same = [](WORD opcode) { return [=](WORD) { return opcode; }; };
+    auto with = [&](std::vector<WORD> extra) {
+        std::vector<WORD> setup = base;
+        setup.insert(setup.end(), extra.begin(), extra.end());
+        return setup;
+    };
+
+    std::vector<micro_case> cases = {
+        {"0NNN (dispatch only)",    base, same(0x0123)},
+        {"00E0",                    base, same(0x00E0)},
+        {"1NNN",                    base, [](WORD a) { return (WORD)(0x1000 | (a + 2)); }},
+        {"2NNN+00EE",               base, same(0x2000 | SUBROUTINE)},
+        {"3XNN",                    base, same(0x3101)},
+        {"4XNN",                    base, same(0x4100)},
+        {"5XY0",                    with({0x6101}), same(0x5120)},
+        {"6XNN",                    base, same(0x6123)},
+        {"7XNN",                    base, same(0x7101)},
+        {"8XY0",                    base, same(0x8120)},
+        {"8XY1",                    base, same(0x8121)},
+        {"8XY2",                    base, same(0x8122)},
+        {"8XY3",                    base, same(0x8123)},
+        {"8XY4",                    base, same(0x8124)},
+        {"8XY5",                    base, same(0x8125)},
+        {"8XY6",                    base, same(0x8126)},
+        {"8XY7",                    base, same(0x8127)},
+        {"8XYE",                    base, same(0x812E)},
+        {"9XY0",                    base, same(0x9120)},
+        {"ANNN",                    base, same(0xA000 | SPRITE_DATA)},
+        {"BNNN",                    base, [](WORD a) { return (WORD)(0xB000 | (a + 2)); }},
+        {"CXNN",                    base, same(0xC1FF)},
+        {"EX9E",                    base, same(0xE19E)},
+        {"EXA1",                    with({0x6101}), same(0xE1A1)},
+        {"FX07",                    base, same(0xF107)},
+        {"FX0A (waiting)",          base, same(0xF10A)},
+        {"FX15",                    base, same(0xF115)},
+        {"FX18",                    base, same(0xF118)},
+        {"FX1E",                    base, same(0xF11E)},
+        {"FX29",                    base, same(0xF129)},
+        {"FX33",                    base, same(0xF133)},
+        {"FX55",                    base, same(0xF355)},
+        {"FX65",                    base, same(0xF365)},
+        // Sprite height and position, the wrapping cases split the sprite over two words or rows
+        {"DXYN h1",                 base, same(0xD011)},
+        {"DXYN h5",                 base, same(0xD015)},
+        {"DXYN h15",                base, same(0xD01F)},
+        {"DXYN h5 x=3",             with({0x6003}), same(0xD015)},
+        {"DXYN h5 x=60 wrap",       with({0x603C}), same(0xD015)},
+        {"DXYN h15 y=24 wrap",      with({0x6118}), same(0xD01F)},
+    };
+    return cases;
+}
+
+// Best time over opt.repeat runs of fn, in seconds
+double best_of(const options &opt, const std::function<void()> &setup, const std::function<void()> &fn) {
+    double best = 1e30;
+    for (int r = 0; r < opt.repeat; r++) {
+        setup();
+        auto start = bench_clock::now();
+        fn();
+        double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+        best = std::min(best, seconds);
+    }
+    return best;
+}
+
+std::string json_string(const std::string &s) {
+    std::string out = "\"";
+    for (char ch : s) {
+        if (ch == '"' || ch == '\\')
+            out += '\\';
+        if ((unsigned char)ch < 0x20)
+            continue;
+        out += ch;
+    }
+    return out + "\"";
+}
+
+void run_micro(const options &opt, FILE *out) {
+    std::unique_ptr<chip8> c(new chip8());
+    c->set_engine(opt.engine);
+    c->seed(1);
+
+    fprintf(out, "  \"micro\": [\n");
+    std::vector<micro_case> cases = micro_cases();
+    for (size_t i = 0; i < cases.size(); i++) {
+        std::vector<BYTE> rom = build_rom(cases[i]);
+        double seconds = best_of(opt, [&] {
+            c->load(rom.data(), rom.size());
+            c->run(2 * BODY_COPIES); // warm up, the cache (or JIT) is filled outside the timing
+        }, [&] {
+            // run() takes an int, longer runs go in pieces
+            for (long long left = opt.cycles; left > 0; left -= INT_MAX)
+                c->run((int)std::min<long long>(left, INT_MAX));
+        });
+        fprintf(out, "    {\"name\": %s, \"ns_per_op\": %.3f}%s\n", json_string(cases[i].name).c_str(),
+            seconds * 1e9 / opt.cycles, i + 1 < cases.size() ? "," : "");
+    }
+    fprintf(out, "  ],\n");
+
+    // Cold pass right after load() against a warm pass over the same 1024 distinct instructions
+    micro_case fresh = {"decode", {}, [](WORD a) { return (WORD)(0x6000 | (a & 0xFFF)); }};
+    std::vector<BYTE> rom = build_rom(fresh);
+    double cold = best_of(opt, [&] {
+        c->load(rom.data(), rom.size());
+        c->run(1);
+    }, [&] {
+        c->run(BODY_COPIES);
+    });
+    double warm = best_of(opt, [&] {
+        c->load(rom.data(), rom.size());
+        c->run(BODY_COPIES + 2);
+    }, [&] {
+        c->run(BODY_COPIES);
+    });
+    fprintf(out, "  \"decode\": {\"cold_ns_per_op\": %.3f, \"warm_ns_per_op\": %.3f, \"decode_ns_per_op\": %.3f},\n",
+        cold * 1e9 / BODY_COPIES, warm * 1e9 / BODY_COPIES, (cold - warm) * 1e9 / BODY_COPIES);
+}
+
+void run_macro(const options &opt, const std::vector<std::vector<BYTE>> &images, FILE *out) {
+    std::unique_ptr<chip8> c(new chip8());
+    c->set_engine(opt.engine);
+    long long frames = (long long)opt.seconds * 60;
+    long long instructions = frames * opt.cpf;
+
+    fprintf(out, "  \"macro\": [\n");
+    for (size_t r = 0; r < images.size(); r++) {
+        bool loaded = true;
+        c->set_variant(opt.variants[r]);
+        double seconds = best_of(opt, [&] {
+            c->seed(1);
+            loaded = c->load(images[r].data(), images[r].size());
+        }, [&] {
+            if (!loaded)
+                return;
+            for (long long f = 0; f < frames; f++) {
+                c->run(opt.cpf);
+                c->tick_timers();
+            }
+        });
+        fprintf(out, "    {\"rom\": %s, ", json_string(opt.roms[r]).c_str());
+        if (!loaded)
+            fprintf(out, "\"error\": \"too large to fit in memory\"}");
+        else
+            fprintf(out, "\"instructions\": %lld, \"frames\": %lld, \"seconds\": %.6f, \"instructions_per_sec\": %.0f, \"frames_per_sec\": %.0f, \"ns_per_instruction\": %.3f}",
+                instructions, frames, seconds, instructions / seconds, frames / seconds, seconds * 1e9 / instructions);
+        fprintf(out, "%s\n", r + 1 < images.size() ? "," : "");
+    }
+    fprintf(out, "  ],\n");
+}
+
+int main(int argc, char **argv) {
+    options opt;
+    if (!parse_args(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    if (opt.macro && !resolve_roms(opt.roms, opt.variants))
+        return 1;
+
+    std::vector<std::vector<BYTE>> images(opt.roms.size());
+    for (size_t r = 0; r < opt.roms.size(); r++) {
+        if (!read_rom(opt.roms[r], images[r])) {
+            std::cerr << "Error: could not read " << opt.roms[r] << "\n";
+            return 1;
+        }
+    }
+
+    FILE *out = stdout;
+    if (!opt.output.empty() && (out = fopen(opt.output.c_str(), "w")) == NULL) {
+        std::cerr << "Error: could not write " << opt.output << "\n";
+        return 1;
+    }
+
+    // The engine actually used, set_engine() falls back when the build or host can't do it
+    std::unique_ptr<chip8> probe(new chip8());
+    probe->set_engine(opt.engine);
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"engine\": \"%s\",\n", engine_name(probe->get_engine()));
+#ifdef __VERSION__
+    fprintf(out, "  \"compiler\": %s,\n", json_string(__VERSION__).c_str());
+#endif
+    fprintf(out, "  \"repeat\": %d,\n", opt.repeat);
+    if (opt.micro)
+        run_micro(opt, out);
+    if (opt.macro)
+        run_macro(opt, images, out);
+    fprintf(out, "  \"cycles_per_frame\": %d\n", opt.cpf);
+    fprintf(out, "}\n");
+
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
@@ -0,0 +1,205 @@
+#include "../headers/cfg.h"
+#include "../headers/disasm.h"
+
+#include <algorithm>
+#include <cstdio>
+
+static bool is_skip(Opcode kind) {
+    switch (kind) {
+        case OPC_3XNN: case OPC_4XNN: case OPC_5XY0: case OPC_9XY0: case OPC_EX9E: case OPC_EXA1:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Instructions a block can't continue past
+static bool ends_block(Opcode kind) {
+    switch (kind) {
+        case OPC_1NNN: case OPC_2NNN: case OPC_00EE: case OPC_BNNN: case OPC_FX0A: case OPC_00FD:
+        case OPC_FX33: case OPC_FX55: case OPC_5XY2: case OPC_INVALID:
+            return true;
+        default:
+            return is_skip(kind);
+    }
+}
+
+// Bytes past the instruction that decide where it goes: an XO-CHIP skip steps over 4 bytes
+// when the next word is F000
+static int peeked(const chip8 &c, Opcode kind) {
+    return c.get_quirks().xochip && is_skip(kind) ? 2 : 0;
+}
+
+// The instruction at a, and everything it depends on, lies in the first 4 KB
+static bool fits(const chip8 &c, WORD a) {
+    Opcode kind = c.kind_at(a);
+    return a + instruction_size(kind) + peeked(c, kind) <= (int)CODE_SIZE;
+}
+
+static int skip_size(const chip8 &c, WORD next) {
+    return c.get_quirks().xochip && c.opcode_at(next) == 0xF000 ? 4 : 2;
+}
+
+void rom_cfg::build(const chip8 &c, size_t rom_size) {
+    blocks.clear();
+    calls.clear();
+    computed_jumps.clear();
+    memset(code, 0, sizeof(code));
+    rom_end = 0x200 + rom_size;
+
+    // Walk every path once, noting where blocks have to start
+    std::vector<bool> seen(CODE_SIZE), leader(CODE_SIZE);
+    std::vector<WORD> work;
+    auto target = [&](int t) {
+        if (t >= (int)CODE_SIZE)
+            return;
+        leader[t] = true;
+        if (!seen[t])
+            work.push_back((WORD)t);
+    };
+    target(0x200);
+    while (!work.empty()) {
+        WORD a = work.back();
+        work.pop_back();
+        while (a < CODE_SIZE && !seen[a] && fits(c, a)) {
+            seen[a] = true;
+            Opcode kind = c.kind_at(a);
+            WORD op = c.opcode_at(a);
+            int next = a + instruction_size(kind);
+            for (int i = a; i < next; i++)
+                code[i] = 1;
+            if (kind == OPC_FX0A || kind == OPC_00FD)
+                leader[a] = true;
+            if (kind == OPC_1NNN) {
+                target(op & 0xFFF);
+                break;
+            }
+            if (kind == OPC_2NNN) {
+                calls.push_back(op & 0xFFF);
+                target(op & 0xFFF);
+                target(next);
+                break;
+            }
+            if (is_skip(kind)) {
+                target(next);
+                target(next + skip_size(c, next));
+                break;
+            }
+            if (kind == OPC_BNNN)
+                computed_jumps.push_back(a);
+            if (kind == OPC_00EE || kind == OPC_BNNN || kind == OPC_00FD || kind == OPC_INVALID)
+                break;
+            if (ends_block(kind)) {
+                target(next);
+                break;
+            }
+            a = next;
+        }
+    }
+    std::sort(calls.begin(), calls.end());
+    calls.erase(std::unique(calls.begin(), calls.end()), calls.end());
+    std::sort(computed_jumps.begin(), computed_jumps.end());
+
+    // Then cut the paths into blocks at those addresses
+    for (int start = 0; start < (int)CODE_SIZE; start++) {
+        if (!leader[start] || !fits(c, start))
+            continue;
+        cfg_block b;
+        b.start = start;
+        b.count = 0;
+        b.computed = false;
+        WORD a = start;
+        Opcode kind = OPC_0NNN;
+        for (;;) {
+            kind = c.kind_at(a);
+            b.last = a;
+            b.count++;
+            a += instruction_size(kind);
+            if (ends_block(kind) || a >= CODE_SIZE || leader[a] || !fits(c, a))
+                break;
+        }
+        b.end = a;
+        b.last_kind = kind;
+        b.bytes = b.end - b.start + peeked(c, kind);
+        WORD op = c.opcode_at(b.last);
+        switch (kind) {
+            case OPC_1NNN:  b.next.push_back(op & 0xFFF);                       break;
+            case OPC_2NNN:  b.next.push_back(op & 0xFFF); b.next.push_back(a);  break;
+            case OPC_FX0A:  b.next.push_back(a); b.next.push_back(b.last);      break;
+            case OPC_00FD:  b.next.push_back(b.last);                           break;
+            case OPC_00EE: case OPC_BNNN: case OPC_INVALID:
+                b.computed = true;
+                break;
+            default:
+                if (is_skip(kind)) {
+                    b.next.push_back(a);
+                    b.next.push_back(a + skip_size(c, a));
+                }
+                else
+                    b.next.push_back(a);
+                break;
+        }
+        // Only successors that are blocks, anything else is left to the interpreter
+        b.next.erase(std::remove_if(b.next.begin(), b.next.end(), [&](WORD t) {
+            return t >= CODE_SIZE || !leader[t] || !fits(c, t);
+        }), b.next.end());
+        blocks.push_back(b);
+    }
+}
+
+int rom_cfg::find(WORD start) const {
+    auto it = std::lower_bound(blocks.begin(), blocks.end(), start,
+        [](const cfg_block &b, WORD s) { return b.start < s; });
+    return it != blocks.end() && it->start == start ? (int)(it - blocks.begin()) : -1;
+}
+
+// Blocks in address order with their disassembly and where they go, and the stretches of the
+// ROM that no path reached in between
+std::string rom_cfg::listing(const chip8 &c) const {
+    std::string out;
+    char line[128];
+    int reached = 0;
+    for (size_t a = 0x200; a < rom_end && a < CODE_SIZE; a++)
+        reached += code[a];
+    snprintf(line, sizeof(line), "%zu blocks, %zu subroutines, %zu computed jumps, %d of %zu bytes reached as code\n",
+        blocks.size(), calls.size(), computed_jumps.size(), reached, rom_end - 0x200);
+    out += line;
+
+    size_t data = 0x200; // start of the data stretch being skipped over, if any
+    auto flush_data = [&](size_t upto) {
+        if (upto > data) {
+            snprintf(line, sizeof(line), "\n0x%03zX-0x%03zX  data, %zu bytes\n", data, upto - 1, upto - data);
+            out += line;
+        }
+    };
+    for (const cfg_block &b : blocks) {
+        if (b.start >= 0x200) {
+            flush_data(b.start);
+            data = std::max(data, (size_t)b.end);
+        }
+        bool call = std::binary_search(calls.begin(), calls.end(), b.start);
+        snprintf(line, sizeof(line), "\n0x%03X:%s\n", b.start, call ? "  subroutine" : "");
+        out += line;
+        for (WORD a = b.start; a < b.end; ) {
+            Opcode kind = c.kind_at(a);
+            WORD op = c.opcode_at(a);
+            if (kind == OPC_F000)
+                snprintf(line, sizeof(line), "    0x%03X  %04X %04X  LD I, 0x%04X\n", a, op, c.opcode_at(a + 2), c.opcode_at(a + 2));
+            else
+                snprintf(line, sizeof(line), "    0x%03X  %04X       %s\n", a, op, disassemble(op).c_str());
+            out += line;
+            a += instruction_size(kind);
+        }
+        std::string next;
+        for (WORD t : b.next) {
+            snprintf(line, sizeof(line), "%s0x%03X", next.empty() ? "" : ", ", t);
+            next += line;
+        }
+        if (b.computed)
+            next += next.empty() ? "computed" : ", computed";
+        if (!next.empty())
+            out += "    -> " + next + "\n";
+    }
+    flush_data(std::min(rom_end, CODE_SIZE));
+    return out;
+}
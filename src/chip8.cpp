@@ -1,256 +1,380 @@
 #include "../headers/chip8.h"
+#include "../headers/jit.h"
+#include "../headers/aot.h"
+#include "../headers/library.h"
 #include <cstdio>
+#include <algorithm>
 
-void chip8::init(const std::string &game) {
-    I = 0; // reset address register
-    pc = 0x200; // chip8 programs start here
-    stack_ptr = 0; // reset stack pointer
-
-    memset(registers, 0, sizeof(registers)); // clear registers
-    memset(display, 0, sizeof(display)); // clear display
-    stack.clear(); // clear stack
-    memset(memory, 0, sizeof(memory)); // clear memory
-    memset(keys, 0, sizeof(keys)); // clear keys
-    srand(time(0)); // seed random number generator, used by opcode CXNN
-
-    // reset timers
-    delay_timer = 0;
-    sound_timer = 0;
+// Seeded from the clock unless the caller picks a seed before loading
+chip8::chip8() {
+    seed((uint64_t)time(0));
+    use_quirks<quirks_default>();
+}
 
-    // load game data
-    std::cout << "Loading " << game.c_str() << "\n";
-    FILE *f = fopen(game.c_str(), "rb");
+// Out of line so unique_ptr<jit> and unique_ptr<aot> see the complete types
+chip8::~chip8() {}
 
-    if (f == NULL) {
-        std::cerr << "Failed to open file: " << game << "\n";
-        fclose(f);
-        return;
+// Success and failure both go to the trace, the caller decides what to tell the user. The file
+// is mapped, not read, and load() copies it straight into memory.
+bool chip8::init(const std::string &game) {
+    rom_file file;
+    if (!file.open(game)) {
+        TRACE(trace, TRACE_ERROR, TR_ROM_FAILED, 0, 0, LOAD_OPEN);
+        return false;
     }
-    
-    // load font into memory
-    for (int i = 0; i < 80; i++)
-        memory[i] = font[i];
 
-    // get file size
-    fseek(f, 0, SEEK_END);
-    long filesize = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    std::cout << "File has size of " << filesize << " bytes\n";
-    if (filesize > (4096 - 0x200)) {
-        std::cerr << "File is too large to fit in memory" << "\n";
-        fclose(f);
-        return;
+    WORD size = file.size() > 0xFFFF ? 0xFFFF : (WORD)file.size();
+    if (file.size() > MAX_ROM_SIZE) {
+        TRACE(trace, TRACE_ERROR, TR_ROM_FAILED, 0, size, LOAD_TOO_LARGE);
+        return false;
     }
 
-    // read data from f into memory starting at the address of byte 0x200
-    size_t bytesread = fread(&memory[0x200], 1, filesize, f);
-    fclose(f);
+    if (!load(file.data(), file.size()))
+        return false;
 
-    if (bytesread != filesize) {
-        std::cerr << "Failed to read entire file. Read " << bytesread << " bytes out of " << filesize << " bytes";
-        return;
-    }
+    TRACE(trace, TRACE_INFO, TR_ROM_LOADED, 0, size);
+    return true;
+}
+
+// Loads a ROM image that is already in host memory. Doesn't print anything, so
+// the headless runner can load hundreds of instances from one buffer.
+bool chip8::load(const BYTE *rom, size_t size) {
+    if (size > MAX_ROM_SIZE)
+        return false;
+
+    // clear memory, registers, stack, display, keys and timers in one go
+    memset(static_cast<machine_state *>(this), 0, sizeof(machine_state));
+    pc = 0x200; // chip8 programs start here
+    planes = 1;
+    pitch = 64;
+    dirty_rows = ~0ull;
+    call_depth = 0;
+    seed(rng_seed); // restart random number generator, used by opcode CXNN
+
+    // load font into memory
+    for (int i = 0; i < 80; i++)
+        memory[i] = font[i];
+    for (int i = 0; i < 160; i++)
+        memory[BIG_FONT + i] = big_font[i];
 
-    std::cout << "File read succesfully. " << bytesread << " bytes read.\n";
-    std::cout << "First 16 bits: ";
-    for (int i = 0x200; i < 0x210; i++)
-        std::cout << memory[i] << " ";
+    memcpy(&memory[0x200], rom, size);
+    rom_hash = fnv1a(rom, size);
+    memory_top = std::max(CODE_SIZE, (0x200 + size + 7) & ~(size_t)7);
+    flush_icache();
+    if (jit_engine)
+        jit_engine->flush();
+    if (aot_engine)
+        aot_engine->bind();
+    return true;
 }
 
 // Main difference with init is that game and font already loaded into memory
 void chip8::reset() {
     I = 0; 
     pc = 0x200; 
-    stack_ptr = 0; 
+    sp = 0; 
+    call_depth = 0;
 
     memset(registers, 0, sizeof(registers));
     memset(display, 0, sizeof(display));
-    stack.clear(); 
+    hires = 0; // the RPL flags are kept, like they were on the HP-48
+    planes = 1;
+    pitch = 64;
+    pattern_set = 0;
+    dirty_rows = ~0ull;
+    memset(stack, 0, sizeof(stack)); 
     memset(keys, 0, sizeof(keys)); 
-    srand(time(0)); 
+    seed(rng_seed); 
 
     delay_timer = 0;
     sound_timer = 0;
 }
 
-WORD chip8::fetch() {
-    // each 16 bit opcode is comprised of the current and next byte in memory
-    WORD opcode = memory [pc] << 8 | memory [++pc] ;
-    pc++;
-    return opcode;
+// Reads the 16 bit opcode made of the byte at addr and the byte after it
+WORD chip8::fetch(WORD addr) const {
+    return memory [addr & 0xFFF] << 8 | memory [(addr + 1) & 0xFFF];
+}
+
+// Same order as the Opcode enum
+template <class Q>
+const chip8::handler chip8::handlers[OPC_COUNT] = {
+    &call<&chip8::opc0NNN>, &call<&chip8::opc00E0>, &call<&chip8::opc00EE>, &call<&chip8::opc1NNN>, &call<&chip8::opc2NNN>,
+    &call<&chip8::opc3XNN<Q>>, &call<&chip8::opc4XNN<Q>>, &call<&chip8::opc5XY0<Q>>, &call<&chip8::opc6XNN>, &call<&chip8::opc7XNN>,
+    &call<&chip8::opc8XY0>, &call<&chip8::opc8XY1<Q>>, &call<&chip8::opc8XY2<Q>>, &call<&chip8::opc8XY3<Q>>, &call<&chip8::opc8XY4>,
+    &call<&chip8::opc8XY5>, &call<&chip8::opc8XY6<Q>>, &call<&chip8::opc8XY7>, &call<&chip8::opc8XYE<Q>>, &call<&chip8::opc9XY0<Q>>,
+    &call<&chip8::opcANNN>, &call<&chip8::opcBNNN<Q>>, &call<&chip8::opcCXNN>, &call<&chip8::opcDXYN<Q>>, &call<&chip8::opcEX9E<Q>>,
+    &call<&chip8::opcEXA1<Q>>, &call<&chip8::opcFX07>, &call<&chip8::opcFX0A>, &call<&chip8::opcFX15>, &call<&chip8::opcFX18>,
+    &call<&chip8::opcFX1E>, &call<&chip8::opcFX29>, &call<&chip8::opcFX33<Q>>, &call<&chip8::opcFX55<Q>>, &call<&chip8::opcFX65<Q>>,
+    &call<&chip8::opc00CN>, &call<&chip8::opc00FB>, &call<&chip8::opc00FC>, &call<&chip8::opc00FD>, &call<&chip8::opc00FE>,
+    &call<&chip8::opc00FF>, &call<&chip8::opcDXY0<Q>>, &call<&chip8::opcFX30>, &call<&chip8::opcFX75>, &call<&chip8::opcFX85>,
+    &call<&chip8::opc00DN>, &call<&chip8::opc5XY2>, &call<&chip8::opc5XY3>, &call<&chip8::opcF000>, &call<&chip8::opcFN01>,
+    &call<&chip8::opcF002>, &call<&chip8::opcFX3A>,
+    &call<&chip8::opcInvalid>
+};
+
+template <class Q>
+void chip8::use_quirks() {
+    handler_table = handlers<Q>;
+    threaded = &chip8::run_threaded<Q>;
+    quirks = flags_of<Q>();
 }
 
-void chip8::decode(WORD opcode) {
-    // printf("OPCODE: %#x\n", opcode);
+// Takes effect from the next instruction decoded, so everything decoded or translated so far
+// is dropped. The machine state is left alone, like set_engine().
+void chip8::set_variant(Variant v) {
+    switch (v) {
+        case VARIANT_VIP:       use_quirks<quirks_vip>();       break;
+        case VARIANT_CHIP48:    use_quirks<quirks_chip48>();    break;
+        case VARIANT_SCHIP:     use_quirks<quirks_schip>();     break;
+        case VARIANT_XOCHIP:    use_quirks<quirks_xochip>();    break;
+        default:                use_quirks<quirks_default>(); v = VARIANT_DEFAULT; break;
+    }
+    variant = v;
+    flush_icache();
+    if (jit_engine)
+        jit_engine->flush();
+    if (aot_engine)
+        aot_engine->bind();
+}
+
+// Pull the operands out once and pick the handler. Only runs on an instruction cache miss.
+// The SUPER-CHIP and XO-CHIP instructions are matched on the whole opcode, since on variants
+// without them the same opcodes are 0NNN machine code calls or other instructions.
+chip8::instr chip8::decode(WORD opcode) const {
+    instr op;
+    op.nnn = opcode & 0x0FFF;
+    op.x = (opcode & 0x0F00) >> 8;
+    op.y = (opcode & 0x00F0) >> 4;
+    op.n = opcode & 0x000F;
+    op.nn = opcode & 0x00FF;
+    op.kind = OPC_INVALID;
 
     switch (((opcode & 0xF000) >> 12)) {
         case 0x0:
         {
+            if (quirks.xochip && (opcode & 0xFFF0) == 0x00D0) { op.kind = OPC_00DN; break; }
+            if (quirks.schip) {
+                if ((opcode & 0xFFF0) == 0x00C0) { op.kind = OPC_00CN; break; }
+                switch (opcode) {
+                    case 0x00FB:  op.kind = OPC_00FB;     break;
+                    case 0x00FC:  op.kind = OPC_00FC;     break;
+                    case 0x00FD:  op.kind = OPC_00FD;     break;
+                    case 0x00FE:  op.kind = OPC_00FE;     break;
+                    case 0x00FF:  op.kind = OPC_00FF;     break;
+                }
+                if (op.kind != OPC_INVALID)
+                    break;
+            }
             switch (opcode & 0x00FF) {
-                case 0xE0:    opc00E0();        break;
-                case 0xEE:    opc00EE();        break;
-                default:      opc0NNN(opcode);  break;
+                case 0xE0:    op.kind = OPC_00E0;         break;
+                case 0xEE:    op.kind = OPC_00EE;         break;
+                default:      op.kind = OPC_0NNN;         break;
             }
         }
         break;
-        case 0x1:    opc1NNN(opcode);           break;
-        case 0x2:    opc2NNN(opcode);           break;
-        case 0x3:    opc3XNN(opcode);           break;
-        case 0x4:    opc4XNN(opcode);           break;
-        case 0x5:    opc5XY0(opcode);           break;
-        case 0x6:    opc6XNN(opcode);           break;
-        case 0x7:    opc7XNN(opcode);           break;
+        case 0x1:    op.kind = OPC_1NNN;         break;
+        case 0x2:    op.kind = OPC_2NNN;         break;
+        case 0x3:    op.kind = OPC_3XNN;         break;
+        case 0x4:    op.kind = OPC_4XNN;         break;
+        case 0x5:
+        {
+            op.kind = OPC_5XY0;
+            if (quirks.xochip && op.n == 2)       op.kind = OPC_5XY2;
+            else if (quirks.xochip && op.n == 3)  op.kind = OPC_5XY3;
+        }
+        break;
+        case 0x6:    op.kind = OPC_6XNN;         break;
+        case 0x7:    op.kind = OPC_7XNN;         break;
         case 0x8: 
         {
             switch(opcode & 0x000F) {
-                case 0x0:    opc8XY0(opcode);                                break;
-                case 0x1:    opc8XY1(opcode);                                break;
-                case 0x2:    opc8XY2(opcode);                                break;
-                case 0x3:    opc8XY3(opcode);                                break;
-                case 0x4:    opc8XY4(opcode);                                break;
-                case 0x5:    opc8XY5(opcode);                                break;
-                case 0x6:    opc8XY6(opcode);                                break;
-                case 0x7:    opc8XY7(opcode);                                break;
-                case 0xE:    opc8XYE(opcode);                                break;
-                default:     printf("Error: invalid opcode %#x\n", opcode);  break;
+                case 0x0:     op.kind = OPC_8XY0;         break;
+                case 0x1:     op.kind = OPC_8XY1;         break;
+                case 0x2:     op.kind = OPC_8XY2;         break;
+                case 0x3:     op.kind = OPC_8XY3;         break;
+                case 0x4:     op.kind = OPC_8XY4;         break;
+                case 0x5:     op.kind = OPC_8XY5;         break;
+                case 0x6:     op.kind = OPC_8XY6;         break;
+                case 0x7:     op.kind = OPC_8XY7;         break;
+                case 0xE:     op.kind = OPC_8XYE;         break;
+                default:                                  break;
             }
         }
         break;
-        case 0x9:   opc9XY0(opcode);        break;
-        case 0xA:   opcANNN(opcode);        break;
-        case 0xB:   opcBNNN(opcode);        break;
-        case 0xC:   opcCXNN(opcode);        break;
-        case 0xD:   opcDXYN(opcode);        break;
+        case 0x9:    op.kind = OPC_9XY0;         break;
+        case 0xA:    op.kind = OPC_ANNN;         break;
+        case 0xB:    op.kind = OPC_BNNN;         break;
+        case 0xC:    op.kind = OPC_CXNN;         break;
+        case 0xD:    op.kind = (quirks.schip && op.n == 0) ? OPC_DXY0 : OPC_DXYN; break;
         case 0xE:
         {
             switch(opcode & 0x00FF) {
-                case 0x9E:  opcEX9E(opcode);                                    break;
-                case 0xA1:  opcEXA1(opcode);                                    break;
-                default:    printf("Error: invalid opcode %#x\n", opcode);      break;
+                case 0x9E:    op.kind = OPC_EX9E;         break;
+                case 0xA1:    op.kind = OPC_EXA1;         break;
+                default:                                  break;
             }
         }
         break;
         case 0xF:
         {
+            if (quirks.xochip) {
+                if (opcode == 0xF000) { op.kind = OPC_F000; break; }
+                if (opcode == 0xF002) { op.kind = OPC_F002; break; }
+                if (op.nn == 0x01)    { op.kind = OPC_FN01; break; }
+                if (op.nn == 0x3A)    { op.kind = OPC_FX3A; break; }
+            }
             switch (opcode & 0x0FF) {
-                case 0x07:  opcFX07(opcode);                                break;
-                case 0x0A:  opcFX0A(opcode);                                break;
-                case 0x15:  opcFX15(opcode);                                break;
-                case 0x18:  opcFX18(opcode);                                break;
-                case 0x1E:  opcFX1E(opcode);                                break;
-                case 0x29:  opcFX29(opcode);                                break;
-                case 0x33:  opcFX33(opcode);                                break;
-                case 0x55:  opcFX55(opcode);                                break;
-                case 0x65:  opcFX65(opcode);                                break;
-                default:    printf("Error: invalid opcode %#x\n", opcode);  break;
+                case 0x07:    op.kind = OPC_FX07;         break;
+                case 0x0A:    op.kind = OPC_FX0A;         break;
+                case 0x15:    op.kind = OPC_FX15;         break;
+                case 0x18:    op.kind = OPC_FX18;         break;
+                case 0x1E:    op.kind = OPC_FX1E;         break;
+                case 0x29:    op.kind = OPC_FX29;         break;
+                case 0x33:    op.kind = OPC_FX33;         break;
+                case 0x55:    op.kind = OPC_FX55;         break;
+                case 0x65:    op.kind = OPC_FX65;         break;
+                case 0x30:    if (quirks.schip) op.kind = OPC_FX30; break;
+                case 0x75:    if (quirks.schip) op.kind = OPC_FX75; break;
+                case 0x85:    if (quirks.schip) op.kind = OPC_FX85; break;
+                default:                                  break;
             }
         }
         break;
         default:
-        printf("Error: invalid opcode %#x\n", opcode); 
         break;
     }
+    op.fn = handler_table[op.kind];
+    return op;
+}
+
+// Cache entry for addr, decoding it first if this is the first visit since the last write
+const chip8::instr &chip8::lookup(WORD addr) {
+    instr &op = icache[addr & 0xFFF];
+    if (op.fn == nullptr) {
+        PROFILE_SCOPE(profile, PROF_DECODE);
+        op = decode(fetch(addr));
+    }
+    return op;
+}
+
+// Drops every cached instruction, used whenever memory is replaced wholesale
+void chip8::flush_icache() {
+    for (size_t i = 0; i < CODE_SIZE; i++)
+        icache[i].fn = nullptr;
+}
+
+// Unknown opcodes are cached too, so this only has to recover the opcode for the trace
+void chip8::opcInvalid(const instr &) {
+    TRACE(trace, TRACE_ERROR, TR_INVALID_OPCODE, pc - 2, fetch(pc - 2));
 }
 
 // Jumpy to machine code routine at addres NNN
-void chip8::opc0NNN(WORD opcode) {
+void chip8::opc0NNN(const instr &) {
     // Ignored on modern computers
 }
 
-// Clears the screen
-void chip8::opc00E0() {
-    memset(display, 0, sizeof(display));
+// Clears the screen, on XO-CHIP only the selected planes
+void chip8::opc00E0(const instr &) {
+    for (int p = 0; p < PLANES; p++) {
+        if (planes & (1 << p))
+            memset(display[p], 0, sizeof(display[p]));
+    }
+    dirty_rows |= all_rows();
 }
 
 // Returns from subroutine
-void chip8::opc00EE(){
-    pc = stack.back();
-    stack.pop_back();
+void chip8::opc00EE(const instr &){
+    // The stack has 16 slots and wraps, so a stray return reads garbage instead of past the end
+    if (call_depth == 0)
+        TRACE(trace, TRACE_WARN, TR_STACK_UNDERFLOW, pc - 2);
+    else
+        call_depth--;
+    sp = (sp - 1) & 0xF;
+    pc = stack[sp];
+    transfers++;
 } 
 
 // Jumps to address NNN
-void chip8::opc1NNN(WORD opcode){
+void chip8::opc1NNN(const instr &op){
     // Remember current address 
     // Jump to NNN
-    pc = (opcode & 0x0FFF);
+    pc = op.nnn;
 } 
 
 // Call subroutine at NNN
-void chip8::opc2NNN(WORD opcode) {
-    stack.push_back(pc);
-    pc = (opcode & 0x0FFF);
+void chip8::opc2NNN(const instr &op) {
+    if (++call_depth > 16)
+        TRACE(trace, TRACE_WARN, TR_STACK_OVERFLOW, pc - 2, op.nnn);
+    stack[sp] = pc;
+    sp = (sp + 1) & 0xF;
+    pc = op.nnn;
+    transfers++;
 } 
 
 // Skips next instruction if VX == NN
-void chip8::opc3XNN(WORD opcode) {
-    int X = (opcode & 0x0F00) >> 8;
-    BYTE NN = (opcode & 0x00FF);
-    if (registers[X] == NN)
-        pc+=2;
+template <class Q>
+void chip8::opc3XNN(const instr &op) {
+    if (registers[op.x] == op.nn)
+        skip<Q>();
 } 
 
 // Skips next instruction if VX != NN
-void chip8::opc4XNN(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    BYTE NN = (opcode & 0x00FF);
-    if (registers[x] != NN)
-        pc+=2;
+template <class Q>
+void chip8::opc4XNN(const instr &op) {
+    if (registers[op.x] != op.nn)
+        skip<Q>();
 } 
 
 // Skips next instruction if VX == VY
-void chip8::opc5XY0(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    int y = (opcode & 0x00F0) >> 4;
-    if (registers[x] == registers[y])
-        pc+=2;
+template <class Q>
+void chip8::opc5XY0(const instr &op) {
+    if (registers[op.x] == registers[op.y])
+        skip<Q>();
 }
 
 // Sets VX to NN
-void chip8::opc6XNN(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    BYTE NN = (opcode & 0x00FF);
-    registers[x] = NN;
+void chip8::opc6XNN(const instr &op) {
+    registers[op.x] = op.nn;
 }
 
 // Adds NN to VX
-void chip8::opc7XNN(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    BYTE NN = (opcode & 0x00FF);
-    registers[x] += NN;
+void chip8::opc7XNN(const instr &op) {
+    registers[op.x] += op.nn;
 }
 
 // Set VX to value of VY
-void chip8::opc8XY0(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    int y = (opcode & 0x00F0) >> 4;
-    registers[x] = registers[y];
+void chip8::opc8XY0(const instr &op) {
+    registers[op.x] = registers[op.y];
 }
 
 // Sets VX to VX | VY
-void chip8::opc8XY1(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    int y = (opcode & 0x00F0) >> 4;
-    registers[x] |= registers[y];
+template <class Q>
+void chip8::opc8XY1(const instr &op) {
+    registers[op.x] |= registers[op.y];
+    if (Q::vf_reset)
+        registers[VF] = 0;
 }
 
 // Sets VX to VX & VY
-void chip8::opc8XY2(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    int y = (opcode & 0x00F0) >> 4;
-    registers[x] &= registers[y];
+template <class Q>
+void chip8::opc8XY2(const instr &op) {
+    registers[op.x] &= registers[op.y];
+    if (Q::vf_reset)
+        registers[VF] = 0;
 }
 
 // Sets VX to VX ^ VY
-void chip8::opc8XY3(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    int y = (opcode & 0x00F0) >> 4;
-    registers[x] ^= registers[y];
+template <class Q>
+void chip8::opc8XY3(const instr &op) {
+    registers[op.x] ^= registers[op.y];
+    if (Q::vf_reset)
+        registers[VF] = 0;
 }
 
 // Add VY to VX and set VF to 1 if overflow else 0
-void chip8::opc8XY4(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    int y = (opcode & 0x00F0) >> 4;
+void chip8::opc8XY4(const instr &op) {
+    int x = op.x;
+    int y = op.y;
 
     // Overflows if vx + vy > 0xFF      ==>     vy > 0xFF - vx
     registers[VF] = 0;
@@ -261,9 +385,9 @@ void chip8::opc8XY4(WORD opcode) {
 }
 
 // Subtract VY from VX and set VF to 0 if underflow else 1
-void chip8::opc8XY5(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    int y = (opcode & 0x00F0) >> 4;
+void chip8::opc8XY5(const instr &op) {
+    int x = op.x;
+    int y = op.y;
 
     // Underflows if vx - vy < 0        ==>     if vx < vy
     registers[VF] = 1;
@@ -273,19 +397,19 @@ void chip8::opc8XY5(WORD opcode) {
     registers[x] -= registers[y];
 }
 
-// Shift VX to right by 1, store LSB of VX before shift into VF
-void chip8::opc8XY6(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    BYTE VX = registers[x];
-    BYTE LSB = VX & 1;
-    registers[x] >>= 1;
+// Shift VX (or VY) to right by 1 into VX, store LSB before shift into VF
+template <class Q>
+void chip8::opc8XY6(const instr &op) {
+    BYTE from = registers[Q::shift_vy ? op.y : op.x];
+    BYTE LSB = from & 1;
+    registers[op.x] = from >> 1;
     registers[VF] = LSB;
 }
 
 // Subtract VX from VY and set VX to the difference and set VF to 0 if underflow else 1
-void chip8::opc8XY7(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    int y = (opcode & 0x00F0) >> 4;
+void chip8::opc8XY7(const instr &op) {
+    int x = op.x;
+    int y = op.y;
 
     // Underflow if vy - vx < 0     ==>     if vy < vx
     registers[VF] = 1;
@@ -295,110 +419,168 @@ void chip8::opc8XY7(WORD opcode) {
     registers[x] = (registers[y] - registers[x]);
 }
 
-// Shift VX to left by 1, store MSB of VX before shift into VF
-void chip8::opc8XYE(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    BYTE VX = registers[x];
-    BYTE MSB = (VX & 128) >> 7;
-    registers[x] <<= 1;
+// Shift VX (or VY) to left by 1 into VX, store MSB before shift into VF
+template <class Q>
+void chip8::opc8XYE(const instr &op) {
+    BYTE from = registers[Q::shift_vy ? op.y : op.x];
+    BYTE MSB = (from & 128) >> 7;
+    registers[op.x] = from << 1;
     registers[VF] = MSB;
 }
 
 // Skips the next instruction if VX != VY
-void chip8::opc9XY0(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    int y = (opcode & 0x00F0) >> 4;
-    if (registers[x] != registers[y])
-        pc+=2;
+template <class Q>
+void chip8::opc9XY0(const instr &op) {
+    if (registers[op.x] != registers[op.y])
+        skip<Q>();
 }
 
 // Sets I to address NNN
-void chip8::opcANNN(WORD opcode) {
-    WORD NNN = opcode & 0x0FFF;
-    I = NNN;
+void chip8::opcANNN(const instr &op) {
+    I = op.nnn;
 }
 
-// Jumps to address NNN plus V0
-void chip8::opcBNNN(WORD opcode) {
-    WORD NNN = opcode & 0x0FFF;
-    pc = (registers[V0] + NNN);
+// Jumps to address NNN plus V0, or with jump_vx to XNN plus VX
+template <class Q>
+void chip8::opcBNNN(const instr &op) {
+    pc = (registers[Q::jump_vx ? op.x : (BYTE)V0] + op.nnn);
+    transfers++;
 }
 
 // Set VX to a random num [0, 255] & NN
-void chip8::opcCXNN(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    int NN = opcode & 0x00FF;
-    int rnd = rand() % 256;
-    registers[x] = rnd & NN;
+void chip8::opcCXNN(const instr &op) {
+    registers[op.x] = random_byte() & op.nn;
 }
 
 // Draw a sprite on coordinate (VX, VY) with width = 8px, height = N pixels (num rows to draw)
 // Each row of pixels read starting from memory location I
 // VF set to 1 if pixels flipped else 0
-void chip8::opcDXYN(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    int y = (opcode & 0x00F0) >> 4;
-    int N = (opcode & 0x000F);
-    int VX = registers[x]; 
-    int VY = registers[y];
-    registers[VF] = 0;
+// The starting position always wraps, with clip the sprite is cut off at the edges past that
+template <class Q>
+void chip8::opcDXYN(const instr &op) {
+    if (hires)
+        draw_sprite<Q, true>(op, op.n, 8);
+    else
+        draw_sprite<Q, false>(op, op.n, 8);
+}
+
+// SUPER-CHIP: draw a 16x16 sprite, two bytes per row, in either mode
+template <class Q>
+void chip8::opcDXY0(const instr &op) {
+    if (hires)
+        draw_sprite<Q, true>(op, 16, 16);
+    else
+        draw_sprite<Q, false>(op, 16, 16);
+}
 
-    // For each row (going down the screen)
-    for (int i = 0; i < N; i++) {
-        int ycoord = (VY+i)%32;
-        BYTE sprite = memory [I+i];
+// Each sprite row is lined up in one word and XORed onto the screen a word at a time, so a 16
+// pixel wide row costs the same as an 8 pixel one. VF is 1 if any pixel was turned off, as on
+// XO-CHIP, rather than the number of colliding rows the original SUPER-CHIP gave in 128x64.
+// On XO-CHIP every selected plane gets its own sprite, one after the other in memory, so two
+// planes cost two passes and no more.
+template <class Q, bool HIRES>
+void chip8::draw_sprite(const instr &op, int rows, int width) {
+    const int W = HIRES ? 128 : 64;
+    const int H = HIRES ? 64 : 32;
+    const WORD mask = address_mask<Q>();
+    int bytes = width / 8;
+    int size = rows * bytes; // one plane's sprite
+    int VX = registers[op.x] % W;
+    int VY = registers[op.y] % H;
+    BYTE selected = Q::xochip ? planes : 1;
+    int count = 0;
+    for (int p = 0; p < PLANES; p++)
+        count += (selected >> p) & 1;
+    registers[VF] = 0;
+    if (I + size * count > mask + 1)
+        TRACE(trace, TRACE_WARN, TR_MEMORY_RANGE, pc - 2, I, size * count);
+    if (Q::clip && VY + rows > H)
+        rows = H - VY;
 
-        // For each col (going across the screen)
-        for (int j = 0; j < 8; j++) {
-            int xcoord = (VX+j)%64;
-            
-            // Iterate thru pixel in the row of this sprite
-            BYTE this_pixel = 0b10000000 >> j;
+    WORD source = I;
+    bool hit = false;
+    for (int p = 0; p < PLANES; p++) {
+        if (!(selected & (1 << p)))
+            continue;
 
-            // If this pixel is toggled on
-            if (sprite & this_pixel) {
-                int coord = ycoord*64+xcoord;
+        // For each row (going down the screen)
+        for (int i = 0; i < rows; i++) {
+            int row = (VY+i)%H;
 
-                // Collision detected
-                if (display[coord] == 1)
-                    registers[VF] = 1;
+            // Line the sprite's MSB up with the leftmost pixel of a word
+            WORD addr = source + i * bytes;
+            uint64_t sprite = (uint64_t)memory[addr & mask] << 56;
+            if (width == 16)
+                sprite |= (uint64_t)memory[(addr + 1) & mask] << 48;
 
-                display[coord] ^= 1;           
+            uint64_t drawn;
+            if (!HIRES) {
+                // Then move it over to column VX. Rotating instead of shifting wraps the pixels
+                // that fall off the right edge.
+                uint64_t &line = display[p][row][0];
+                if (Q::clip)
+                    sprite >>= VX;
+                else
+                    sprite = (sprite >> VX) | (sprite << ((64 - VX) % 64));
+                hit |= (line & sprite) != 0;
+                line ^= sprite;
+                drawn = sprite;
+            } else {
+                // The sprite lands in the word VX is in and spills into the next one. Past the
+                // right edge the next word is the first one again, unless the variant clips.
+                int shift = VX % 64;
+                uint64_t &first = display[p][row][VX / 64];
+                uint64_t &next = display[p][row][(VX / 64) ^ 1];
+                uint64_t left = sprite >> shift;
+                uint64_t right = shift ? sprite << (64 - shift) : 0;
+                if (Q::clip && VX >= 64)
+                    right = 0;
+                hit |= ((first & left) | (next & right)) != 0;
+                first ^= left;
+                next ^= right;
+                drawn = left | right;
             }
+
+            // An empty sprite row leaves the line as it was, so only mark rows that changed
+            if (drawn)
+                dirty_rows |= 1ull << row;
         }
+        source += size;
     }
+
+    // Collision detected
+    if (hit)
+        registers[VF] = 1;
 }
 
 // Skip next instruction if key in VX is pressed
-void chip8::opcEX9E(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    if (keys[(registers[x])] != 0)
-        pc+=2;
+template <class Q>
+void chip8::opcEX9E(const instr &op) {
+    if (keys[(registers[op.x]) & 0xF] != 0)
+        skip<Q>();
 }
 
 // Skip next instruction if key in VX is not pressed
-void chip8::opcEXA1(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    if (keys[(registers[x])] == 0)
-        pc+=2;
+template <class Q>
+void chip8::opcEXA1(const instr &op) {
+    if (keys[(registers[op.x]) & 0xF] == 0)
+        skip<Q>();
 }
 
 // Set VX to value of delay timer
-void chip8::opcFX07(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    registers[x] = delay_timer;
+void chip8::opcFX07(const instr &op) {
+    registers[op.x] = delay_timer;
 }
 
 // A key press is awaited, then stored in VX (halt all instructions until next event)
-void chip8::opcFX0A(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
+void chip8::opcFX0A(const instr &op) {
     bool anypress = false;
 
     // Iterate thru keys
     for (int i = 0; i < 16; i++) {
         // If a key is pressed, store it 
         if (keys[i] != 0) {
-            registers[x] = i;
+            registers[op.x] = i;
             anypress = 1;
         }
     }
@@ -409,60 +591,524 @@ void chip8::opcFX0A(WORD opcode) {
 }
 
 // Sets delay timer to VX
-void chip8::opcFX15(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    delay_timer = registers[x];
+void chip8::opcFX15(const instr &op) {
+    delay_timer = registers[op.x];
 }
 
 // Sets sound timer to VX
-void chip8::opcFX18(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    sound_timer = registers[x];
+void chip8::opcFX18(const instr &op) {
+    sound_timer = registers[op.x];
 }
 
 // Add VX to I. Don't care about VF
-void chip8::opcFX1E(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    I += registers[x];
+void chip8::opcFX1E(const instr &op) {
+    I += registers[op.x];
 }
 
 // Set I to location of sprite for character in VX
-void chip8::opcFX29(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    
+void chip8::opcFX29(const instr &op) {
     // Each sprite takes up 5 bytes
-    I = (registers[x])*5;
+    I = (registers[op.x])*5;
 }
 
 // Store binary coded decimal representation of VX with hundreds digit in location I, tens digit at I+1, and ones digit at I+2
-void chip8::opcFX33(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
-    BYTE bcd = registers[x]; 
-    memory[I+2] = bcd % 10;
+template <class Q>
+void chip8::opcFX33(const instr &op) {
+    const WORD mask = address_mask<Q>();
+    BYTE bcd = registers[op.x]; 
+    if (I + 3 > mask + 1)
+        TRACE(trace, TRACE_WARN, TR_MEMORY_RANGE, pc - 2, I, 3);
+    write_memory((I+2) & mask, bcd % 10);
     bcd /= 10;
-    memory[I+1] = bcd % 10;
+    write_memory((I+1) & mask, bcd % 10);
     bcd /= 10;
-    memory[I] = bcd;
+    write_memory(I & mask, bcd);
 }
 
 // Stores from V0 to VX in memory, starting at I. 
-void chip8::opcFX55(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
+template <class Q>
+void chip8::opcFX55(const instr &op) {
+    const WORD mask = address_mask<Q>();
+    int x = op.x;
+    if (I + x + 1 > mask + 1)
+        TRACE(trace, TRACE_WARN, TR_MEMORY_RANGE, pc - 2, I, x + 1);
     for (int i = 0; i <= x; i++) 
-        memory[I+i] = registers[i];
-    I += (x + 1); // CHIP-8 version determines whether I is incremented. 
+        write_memory((I+i) & mask, registers[i]);
+    // CHIP-8 version determines whether I is incremented, see IndexQuirk
+    if (Q::index == INDEX_PAST)
+        I += (x + 1);
+    else if (Q::index == INDEX_LAST)
+        I += x;
 }
 
 // Fills from V0 to VX with values from memory, starting at I.
-void chip8::opcFX65(WORD opcode) {
-    int x = (opcode & 0x0F00) >> 8;
+template <class Q>
+void chip8::opcFX65(const instr &op) {
+    const WORD mask = address_mask<Q>();
+    int x = op.x;
+    if (I + x + 1 > mask + 1)
+        TRACE(trace, TRACE_WARN, TR_MEMORY_RANGE, pc - 2, I, x + 1);
     for (int i = 0; i <= x; i++) 
-        registers[i] = memory[I+i];
-    I += (x + 1); // CHIP-8 version determines whether I is incremented. 
+        registers[i] = memory[(I+i) & mask];
+    // CHIP-8 version determines whether I is incremented, see IndexQuirk
+    if (Q::index == INDEX_PAST)
+        I += (x + 1);
+    else if (Q::index == INDEX_LAST)
+        I += x;
+}
+
+// SUPER-CHIP: scrolls the screen down N rows, rows scrolled in at the top are blank. Like all
+// the scrolls, on XO-CHIP it only moves the selected planes.
+void chip8::opc00CN(const instr &op) {
+    int rows = hires ? 64 : 32;
+    int n = op.n;
+    for (int p = 0; p < PLANES; p++) {
+        if (!(planes & (1 << p)))
+            continue;
+        memmove(display[p][n], display[p][0], (rows - n) * sizeof(display[p][0]));
+        memset(display[p][0], 0, n * sizeof(display[p][0]));
+    }
+    dirty_rows |= all_rows();
+}
+
+// XO-CHIP: scrolls the screen up N rows
+void chip8::opc00DN(const instr &op) {
+    int rows = hires ? 64 : 32;
+    int n = op.n;
+    for (int p = 0; p < PLANES; p++) {
+        if (!(planes & (1 << p)))
+            continue;
+        memmove(display[p][0], display[p][n], (rows - n) * sizeof(display[p][0]));
+        memset(display[p][rows - n], 0, n * sizeof(display[p][0]));
+    }
+    dirty_rows |= all_rows();
+}
+
+// SUPER-CHIP: scrolls the screen right 4 pixels. Like 00CN and 00FC this goes by pixels of the
+// mode the screen is in, where the original moved 64x32 pixels by half a pixel. A 128 pixel row
+// is shifted as one 128 bit number made of its two words.
+void chip8::opc00FB(const instr &) {
+    for (int p = 0; p < PLANES; p++) {
+        if (!(planes & (1 << p)))
+            continue;
+        uint64_t (*plane)[2] = display[p];
+        if (hires) {
+            for (int y = 0; y < 64; y++) {
+                plane[y][1] = (plane[y][1] >> 4) | (plane[y][0] << 60);
+                plane[y][0] >>= 4;
+            }
+        } else {
+            for (int y = 0; y < 32; y++)
+                plane[y][0] >>= 4;
+        }
+    }
+    dirty_rows |= all_rows();
+}
+
+// SUPER-CHIP: scrolls the screen left 4 pixels
+void chip8::opc00FC(const instr &) {
+    for (int p = 0; p < PLANES; p++) {
+        if (!(planes & (1 << p)))
+            continue;
+        uint64_t (*plane)[2] = display[p];
+        if (hires) {
+            for (int y = 0; y < 64; y++) {
+                plane[y][0] = (plane[y][0] << 4) | (plane[y][1] >> 60);
+                plane[y][1] <<= 4;
+            }
+        } else {
+            for (int y = 0; y < 32; y++)
+                plane[y][0] <<= 4;
+        }
+    }
+    dirty_rows |= all_rows();
+}
+
+// SUPER-CHIP: exits the interpreter. There is nothing to exit to, so the ROM stays on this
+// instruction until it is reset, and the engines treat it like FX0A waiting for a key.
+void chip8::opc00FD(const instr &) {
+    pc -= 2;
+}
+
+// SUPER-CHIP: back to 64x32
+void chip8::opc00FE(const instr &) {
+    set_hires(false);
+}
+
+// SUPER-CHIP: 128x64
+void chip8::opc00FF(const instr &) {
+    set_hires(true);
+}
+
+// Switching modes clears the screen, every plane of it, as Octo and XO-CHIP do. The original SUPER-CHIP left the
+// pixels where they were, which ROMs can't rely on since they change size.
+void chip8::set_hires(bool on) {
+    memset(display, 0, sizeof(display));
+    hires = on;
+    dirty_rows = ~0ull;
+}
+
+// SUPER-CHIP: set I to the big font digit for the low nibble of VX
+void chip8::opcFX30(const instr &op) {
+    I = BIG_FONT + (registers[op.x] & 0xF) * 10;
+}
+
+// SUPER-CHIP: save V0 to VX in the RPL user flags
+void chip8::opcFX75(const instr &op) {
+    for (int i = 0; i <= op.x; i++)
+        rpl[i] = registers[i];
+}
+
+// SUPER-CHIP: load V0 to VX from the RPL user flags
+void chip8::opcFX85(const instr &op) {
+    for (int i = 0; i <= op.x; i++)
+        registers[i] = rpl[i];
+}
+
+// XO-CHIP: saves VX to VY at I, counting down from VX if Y is below X. I stays where it is.
+void chip8::opc5XY2(const instr &op) {
+    int step = op.x <= op.y ? 1 : -1;
+    int count = (op.x <= op.y ? op.y - op.x : op.x - op.y) + 1;
+    for (int i = 0; i < count; i++)
+        write_memory(I + i, registers[op.x + i * step]);
+}
+
+// XO-CHIP: loads VX to VY from I, the same way round as 5XY2
+void chip8::opc5XY3(const instr &op) {
+    int step = op.x <= op.y ? 1 : -1;
+    int count = (op.x <= op.y ? op.y - op.x : op.x - op.y) + 1;
+    for (int i = 0; i < count; i++)
+        registers[op.x + i * step] = memory[(WORD)(I + i)];
+}
+
+// XO-CHIP: sets I to the 16 bit address in the next two bytes, and steps over them. The
+// address is read when it runs, so the cache entry is for the first half only.
+void chip8::opcF000(const instr &) {
+    I = fetch(pc);
+    pc += 2;
+}
+
+// XO-CHIP: selects the bit planes (N is a mask) that drawing, clearing and scrolling work on
+void chip8::opcFN01(const instr &op) {
+    planes = op.x;
+}
+
+// XO-CHIP: loads the 16 byte audio pattern from I
+void chip8::opcF002(const instr &) {
+    for (int i = 0; i < 16; i++)
+        pattern[i] = memory[(WORD)(I + i)];
+    pattern_set = 1;
+}
+
+// XO-CHIP: sets the pitch the audio pattern plays at
+void chip8::opcFX3A(const instr &op) {
+    pitch = registers[op.x];
 }
 
 // CPU: Fetch-decode-execute cycle 
+// Decoding only happens the first time an address runs (or after its bytes were written to)
 void chip8::cycle() {
-    WORD opcode = fetch();
-    decode(opcode);
-}
\ No newline at end of file
+    const instr &op = lookup(pc);
+    PROFILE_COUNT(profile, pc, op.kind);
+    pc += 2;
+    op.fn(*this, op);
+}
+
+// Runs a batch of cycles back to back, used by frontends that don't care about single steps
+void chip8::run(int cycles) {
+    // Keys and timers may have changed since the last call, a loop has to prove itself again
+    idle.target = 0xFFFF;
+    if (engine == ENGINE_JIT) {
+        jit_engine->run(cycles);
+        return;
+    }
+    if (engine == ENGINE_AOT) {
+        aot_engine->run(cycles);
+        return;
+    }
+    if (engine == ENGINE_THREADED) {
+        (this->*threaded)(cycles);
+        return;
+    }
+    // cycle(), plus the idle checks after backward jumps, FX0A and 00FD
+    while (cycles > 0) {
+        WORD at = pc;
+        const instr &op = lookup(pc);
+        PROFILE_COUNT(profile, pc, op.kind);
+        pc += 2;
+        op.fn(*this, op);
+        cycles--;
+        if (op.kind == OPC_1NNN && pc <= at)
+            cycles = idle_skip(at, cycles);
+        else if ((op.kind == OPC_FX0A || op.kind == OPC_00FD) && pc == at)
+            cycles = idle_wait(cycles);
+    }
+}
+
+// Called right after the backward jump at from went to pc, with the cycles left in this run()
+int chip8::idle_skip(WORD from, int remaining) {
+    WORD target = pc;
+    if (!idle_skip_on || from - target > 2 * (IDLE_BODY - 1))
+        return remaining;
+
+    if (idle.target == target && idle.from == from
+        && memcmp(idle.registers, registers, sizeof(registers)) == 0 && idle.I == I
+        && idle.delay_timer == delay_timer && idle.sound_timer == sound_timer && idle.sp == sp) {
+        int per_pass = idle.remaining - remaining;
+        idle.target = 0xFFFF;
+        // Anything longer than one go through the body and the jump went somewhere else first
+        if (per_pass <= 0 || per_pass > (from - target) / 2 + 1 || idle.transfers != transfers
+            || !idle_body_pure(target, from))
+            return remaining;
+        skipped_cycles += remaining - remaining % per_pass;
+        return remaining % per_pass;
+    }
+
+    idle.target = target;
+    idle.from = from;
+    idle.remaining = remaining;
+    memcpy(idle.registers, registers, sizeof(registers));
+    idle.I = I;
+    idle.delay_timer = delay_timer;
+    idle.sound_timer = sound_timer;
+    idle.sp = sp;
+    idle.transfers = transfers;
+    return remaining;
+}
+
+// True when nothing between target and the jump at from can change state the snapshot
+// doesn't cover (memory, display, stack, random generator) or leave the loop by a jump
+bool chip8::idle_body_pure(WORD target, WORD from) {
+    for (WORD addr = target; addr < from; addr += 2) {
+        switch (lookup(addr).kind) {
+            case OPC_0NNN: case OPC_3XNN: case OPC_4XNN: case OPC_5XY0: case OPC_6XNN: case OPC_7XNN:
+            case OPC_8XY0: case OPC_8XY1: case OPC_8XY2: case OPC_8XY3: case OPC_8XY4: case OPC_8XY5:
+            case OPC_8XY6: case OPC_8XY7: case OPC_8XYE: case OPC_9XY0: case OPC_ANNN: case OPC_EX9E:
+            case OPC_EXA1: case OPC_FX07: case OPC_FX15: case OPC_FX18: case OPC_FX1E: case OPC_FX29:
+            case OPC_FX65: case OPC_FX30: case OPC_FX85:
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+void chip8::set_engine(Engine e) {
+#ifdef CHIP8_PROFILE
+    // Compiled code doesn't go through the counters
+    if (e == ENGINE_JIT || e == ENGINE_AOT)
+        e = ENGINE_THREADED;
+#endif
+    if (e == ENGINE_AOT) {
+        jit_engine.reset();
+        if (!aot_engine)
+            aot_engine.reset(new aot(*this));
+        aot_engine->bind();
+        code_covered = aot_engine->covered;
+        engine = ENGINE_AOT;
+        return;
+    }
+    aot_engine.reset();
+    if (e == ENGINE_JIT && CHIP8_HAS_JIT) {
+        if (!jit_engine)
+            jit_engine.reset(new jit(*this));
+        // mmap can refuse executable memory (e.g. hardened kernels), use the next best engine
+        if (jit_engine->ok()) {
+            code_covered = jit_engine->covered;
+            engine = ENGINE_JIT;
+            return;
+        }
+    }
+    jit_engine.reset();
+    code_covered = nullptr;
+    if (e == ENGINE_JIT)
+        e = ENGINE_THREADED;
+    engine = (e == ENGINE_THREADED && !CHIP8_HAS_THREADED) ? ENGINE_INTERPRETER : e;
+}
+
+// A write landed on code the JIT or the AOT engine translated
+void chip8::invalidate_code(WORD addr) {
+    if (jit_engine)
+        jit_engine->invalidate(addr);
+    else
+        aot_engine->invalidate(addr);
+}
+
+/* Threaded engine
+Every handler gets its own label and ends with its own indirect jump to the next handler,
+instead of all instructions sharing the single call site in cycle(). The branch predictor
+then learns per-handler successor patterns (e.g. 3XNN is usually followed by 1NNN).
+Handlers are the same member functions the interpreter uses, inlined into each label, so
+both engines share one set of semantics. There is one copy of the loop per variant, with
+that variant's quirk handlers inlined.
+*/
+template <class Q>
+void chip8::run_threaded(int cycles) {
+#if CHIP8_HAS_THREADED
+    // Same order as the Opcode enum
+    static void *const labels[OPC_COUNT] = {
+        &&L_0NNN, &&L_00E0, &&L_00EE, &&L_1NNN, &&L_2NNN, &&L_3XNN, &&L_4XNN, &&L_5XY0, &&L_6XNN, &&L_7XNN,
+        &&L_8XY0, &&L_8XY1, &&L_8XY2, &&L_8XY3, &&L_8XY4, &&L_8XY5, &&L_8XY6, &&L_8XY7, &&L_8XYE, &&L_9XY0,
+        &&L_ANNN, &&L_BNNN, &&L_CXNN, &&L_DXYN, &&L_EX9E, &&L_EXA1, &&L_FX07, &&L_FX0A, &&L_FX15, &&L_FX18,
+        &&L_FX1E, &&L_FX29, &&L_FX33, &&L_FX55, &&L_FX65,
+        &&L_00CN, &&L_00FB, &&L_00FC, &&L_00FD, &&L_00FE, &&L_00FF, &&L_DXY0, &&L_FX30, &&L_FX75, &&L_FX85,
+        &&L_00DN, &&L_5XY2, &&L_5XY3, &&L_F000, &&L_FN01, &&L_F002, &&L_FX3A,
+        &&L_Invalid
+    };
+    const instr *op;
+
+    #define DISPATCH()                      \
+        if (cycles-- <= 0) return;          \
+        op = &lookup(pc);                   \
+        PROFILE_COUNT(profile, pc, op->kind); \
+        pc += 2;                            \
+        goto *labels[op->kind]
+
+    #define HANDLER(name)                   \
+        L_##name: opc##name(*op); DISPATCH();
+
+    #define QUIRK_HANDLER(name)             \
+        L_##name: opc##name<Q>(*op); DISPATCH();
+
+    DISPATCH();
+    // The ones that can start an idle loop check for one after running, see idle_skip()
+    L_1NNN: {
+        WORD at = op - icache;
+        opc1NNN(*op);
+        if (pc <= at)
+            cycles = idle_skip(at, cycles);
+        DISPATCH();
+    }
+    L_FX0A: {
+        WORD at = op - icache;
+        opcFX0A(*op);
+        if (pc == at)
+            cycles = idle_wait(cycles);
+        DISPATCH();
+    }
+    L_00FD: {
+        opc00FD(*op);
+        cycles = idle_wait(cycles);
+        DISPATCH();
+    }
+
+    HANDLER(0NNN) HANDLER(00E0) HANDLER(00EE) HANDLER(2NNN) QUIRK_HANDLER(3XNN) QUIRK_HANDLER(4XNN) QUIRK_HANDLER(5XY0)
+    HANDLER(6XNN) HANDLER(7XNN) HANDLER(8XY0) QUIRK_HANDLER(8XY1) QUIRK_HANDLER(8XY2) QUIRK_HANDLER(8XY3) HANDLER(8XY4)
+    HANDLER(8XY5) QUIRK_HANDLER(8XY6) HANDLER(8XY7) QUIRK_HANDLER(8XYE) QUIRK_HANDLER(9XY0) HANDLER(ANNN) QUIRK_HANDLER(BNNN)
+    HANDLER(CXNN) QUIRK_HANDLER(DXYN) QUIRK_HANDLER(EX9E) QUIRK_HANDLER(EXA1) HANDLER(FX07) HANDLER(FX15) HANDLER(FX18)
+    HANDLER(FX1E) HANDLER(FX29) QUIRK_HANDLER(FX33) QUIRK_HANDLER(FX55) QUIRK_HANDLER(FX65) HANDLER(00CN) HANDLER(00FB)
+    HANDLER(00FC) HANDLER(00FE) HANDLER(00FF) QUIRK_HANDLER(DXY0) HANDLER(FX30) HANDLER(FX75) HANDLER(FX85) HANDLER(00DN)
+    HANDLER(5XY2) HANDLER(5XY3) HANDLER(F000) HANDLER(FN01) HANDLER(F002) HANDLER(FX3A) HANDLER(Invalid)
+
+    #undef QUIRK_HANDLER
+    #undef HANDLER
+    #undef DISPATCH
+#else
+    for (int i = 0; i < cycles; i++)
+        cycle();
+#endif
+}
+
+// One byte per pixel (0 or 1) of the first plane, row by row, into a 64*32 buffer, or 128*64 in hires
+void chip8::expand_display(BYTE *out) const {
+    int w = hires ? 128 : 64, h = hires ? 64 : 32;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++)
+            out[y*w+x] = (display[0][y][x / 64] >> (63 - x % 64)) & 1;
+    }
+}
+
+// Compares everything a ROM can observe, used to check the engines against each other
+bool chip8::same_state(const chip8 &other) const {
+    return memcmp(static_cast<const machine_state *>(this), static_cast<const machine_state *>(&other), sizeof(machine_state)) == 0;
+}
+
+void chip8::save_state(machine_state &out) const {
+    out = *this;
+}
+
+// Copies the state back in. Code that differs from what is in memory now has its cached
+// decodes and JIT blocks dropped, compared 64 bytes at a time so the common case where only
+// data changed costs one memcmp per chunk. Past the first 4 KB there is no code to drop.
+// Translated blocks are checked again instead, rewinding to before a ROM rewrote its code
+// brings them back.
+void chip8::load_state(const machine_state &in) {
+    bool rewritten = false;
+    for (int chunk = 0; chunk < (int)CODE_SIZE; chunk += 64) {
+        if (memcmp(&memory[chunk], &in.memory[chunk], 64) == 0)
+            continue;
+        rewritten = true;
+        for (int addr = chunk; addr < chunk + 64; addr++) {
+            if (memory[addr] != in.memory[addr])
+                write_memory(addr, in.memory[addr]);
+        }
+    }
+    static_cast<machine_state &>(*this) = in;
+    // where the 0s start again, the state may come from a file or from before a load()
+    for (memory_top = MEMORY_SIZE; memory_top > CODE_SIZE; memory_top -= 8) {
+        uint64_t w;
+        memcpy(&w, &memory[memory_top - 8], 8);
+        if (w != 0)
+            break;
+    }
+    if (aot_engine && rewritten)
+        aot_engine->bind();
+    dirty_rows = ~0ull;
+    call_depth = sp; // the best guess, how deep the calls went isn't part of the state
+}
+
+// Writes the state only up to state_size(), the rest is memory nothing wrote to. That keeps
+// files from ROMs that stay in the first 4 KB at about 8 KB.
+bool chip8::save_state(const std::string &path) const {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f == NULL)
+        return false;
+    state_header header;
+    memcpy(header.magic, STATE_MAGIC, sizeof(header.magic));
+    header.version = STATE_VERSION;
+    header.size = (uint32_t)state_size();
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+        && fwrite(static_cast<const machine_state *>(this), header.size, 1, f) == 1;
+    return fclose(f) == 0 && ok;
+}
+
+// Leaves the machine untouched unless the whole file is a state this build can read. Whatever
+// the file stops short of is 0.
+bool chip8::load_state(const std::string &path) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL)
+        return false;
+    state_header header;
+    std::unique_ptr<machine_state> in(new machine_state());
+    bool ok = fread(&header, sizeof(header), 1, f) == 1
+        && memcmp(header.magic, STATE_MAGIC, sizeof(header.magic)) == 0
+        && header.version == STATE_VERSION
+        && header.size >= offsetof(machine_state, memory) + CODE_SIZE
+        && header.size <= sizeof(machine_state)
+        && fread(in.get(), header.size, 1, f) == 1;
+    fclose(f);
+    if (ok)
+        load_state(*in);
+    return ok;
+}
+
+// Same seed, same CXNN results. The seed goes through splitmix64 first so that small seeds
+// like 1, 2, 3 still give unrelated sequences, and the generator state is never 0.
+void chip8::seed(uint64_t s) {
+    rng_seed = s;
+    uint64_t z = s + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    rng = z ? z : 0x9E3779B97F4A7C15ull;
+}
+
+// Delay and sound timers count down at 60 Hz, the caller decides when a tick happens
+void chip8::tick_timers() {
+    if (delay_timer > 0)
+        --delay_timer;
+
+    if (sound_timer > 0)
+        --sound_timer;
+}
@@ -0,0 +1,343 @@
+#include "../headers/chip8.h"
+#include "../headers/tools.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <tuple>
+
+/* Conformance runner
+Runs the test ROMs under every quirk profile for a fixed number of frames, with scripted key
+presses, and compares the screen at set frames against golden hashes recorded earlier. Any
+mismatch prints the screen next to the one that was recorded, so a change to the core that
+breaks an opcode shows up as the pixels it broke.
+
+Usage: conform [options]
+    --spec FILE         ROMs, key scripts and checkpoints (default test-roms/conform.txt)
+    --golden FILE       recorded screens (default test-roms/conform.golden)
+    --record            run everything and save the screens as the new goldens
+    -e, --engine NAME   interpreter, threaded, jit or aot (default: threaded where supported)
+    --no-idle-skip      execute idle loops and key waits instruction by instruction
+    -v, --verbose       print every check, not only the ones that failed
+Every run uses the same seed, so ROMs that use CXNN check the same screens every time. ROMs
+that aren't on disk are reported and skipped. Exits with 1 if any check failed or nothing
+was checked at all.
+*/
+
+static const uint64_t CONFORM_SEED = 1;
+
+struct options {
+    std::string spec = "test-roms/conform.txt";
+    std::string golden = "test-roms/conform.golden";
+    bool record = false;
+    Engine engine = CHIP8_HAS_THREADED ? ENGINE_THREADED : ENGINE_INTERPRETER;
+    bool idle_skip = true;
+    bool verbose = false;
+};
+
+struct key_change {
+    long long frame;
+    WORD mask;  // bit k set while key k is down
+};
+
+struct rom_spec {
+    std::string path;
+    std::vector<Variant> variants;
+    int cpf = 700/60;
+    std::vector<key_change> keys;
+    std::vector<long long> checks;
+};
+
+// The hash says whether the screen matches, the rows of the first plane are kept to show how
+// it doesn't: 16 hex digits per word, one word per row in 64x32 and two in 128x64
+struct golden {
+    uint64_t hash;
+    std::string rows;
+};
+
+typedef std::tuple<std::string, int, long long> golden_key; // path, variant, frame
+
+void usage() {
+    std::cerr << "Usage: conform [--spec file] [--golden file] [--record] [-e engine] [--no-idle-skip] [-v]\n";
+}
+
+bool parse_args(int argc, char **argv, options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--spec" && has_value)                           opt.spec = argv[++i];
+        else if (arg == "--golden" && has_value)                    opt.golden = argv[++i];
+        else if (arg == "--record")                                 opt.record = true;
+        else if ((arg == "-e" || arg == "--engine") && has_value) {
+            std::string name = argv[++i];
+            if (!parse_engine(name, opt.engine)) {
+                std::cerr << "Error: unknown engine " << name << "\n";
+                return false;
+            }
+        }
+        else if (arg == "--no-idle-skip")                           opt.idle_skip = false;
+        else if (arg == "-v" || arg == "--verbose")                 opt.verbose = true;
+        else {
+            if (arg != "-h" && arg != "--help")
+                std::cerr << "Error: unknown option " << arg << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// One directive per line, '#' starts a comment. Everything after "rom" belongs to that ROM
+// until the next one.
+bool load_spec(const std::string &path, std::vector<rom_spec> &roms) {
+    std::ifstream in(path);
+    if (!in.is_open()) {
+        std::cerr << "Error: could not read " << path << "\n";
+        return false;
+    }
+    std::string line;
+    int number = 0;
+    auto fail = [&](const std::string &why) {
+        std::cerr << path << ":" << number << ": " << why << "\n";
+        return false;
+    };
+    while (std::getline(in, line)) {
+        number++;
+        while (!line.empty() && (line.back() == ' ' || line.back() == '\r'))
+            line.pop_back();
+        std::istringstream words(line);
+        std::string directive;
+        if (!(words >> directive) || directive[0] == '#')
+            continue;
+        if (directive == "rom") {
+            // the path may have spaces, it is the rest of the line
+            std::string rest;
+            std::getline(words >> std::ws, rest);
+            if (rest.empty())
+                return fail("rom needs a path");
+            roms.push_back(rom_spec());
+            roms.back().path = rest;
+            continue;
+        }
+        if (roms.empty())
+            return fail(directive + " before the first rom");
+        rom_spec &r = roms.back();
+        if (directive == "variants") {
+            std::string name;
+            while (words >> name) {
+                Variant v;
+                if (name == "all") {
+                    for (int i = 0; i < VARIANTS; i++)
+                        r.variants.push_back((Variant)i);
+                }
+                else if (parse_variant(name, v))
+                    r.variants.push_back(v);
+                else
+                    return fail("unknown variant " + name);
+            }
+        }
+        else if (directive == "cpf") {
+            if (!(words >> r.cpf) || r.cpf <= 0)
+                return fail("cpf needs a positive number");
+        }
+        else if (directive == "keys") {
+            key_change k;
+            std::string mask;
+            char *end = nullptr;
+            if (words >> k.frame >> mask)
+                k.mask = (WORD)strtoul(mask.c_str(), &end, 16);
+            if (end == nullptr || *end != 0 || k.frame < 0)
+                return fail("keys needs a frame and a hex mask");
+            r.keys.push_back(k);
+        }
+        else if (directive == "check") {
+            long long frame;
+            while (words >> frame) {
+                if (frame <= 0)
+                    return fail("checks are after at least one frame");
+                r.checks.push_back(frame);
+            }
+        }
+        else
+            return fail("unknown directive " + directive);
+    }
+    for (rom_spec &r : roms) {
+        if (r.variants.empty())
+            for (int i = 0; i < VARIANTS; i++)
+                r.variants.push_back((Variant)i);
+        std::sort(r.checks.begin(), r.checks.end());
+        r.checks.erase(std::unique(r.checks.begin(), r.checks.end()), r.checks.end());
+        std::stable_sort(r.keys.begin(), r.keys.end(), [](const key_change &a, const key_change &b) { return a.frame < b.frame; });
+    }
+    return true;
+}
+
+// hash, variant, frame, rows, then the path, which may have spaces but never a tab. A missing
+// file is fine, it only means nothing has been recorded yet.
+void load_goldens(const std::string &path, std::map<golden_key, golden> &goldens) {
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        unsigned long long hash;
+        char variant[64];
+        long long frame;
+        int used = 0;
+        if (sscanf(line.c_str(), "%16llx\t%63[^\t]\t%lld\t%n", &hash, variant, &frame, &used) != 3 || used == 0)
+            continue;
+        size_t tab = line.find('\t', used);
+        Variant v;
+        if (tab == std::string::npos || !parse_variant(variant, v))
+            continue;
+        goldens[golden_key(line.substr(tab + 1), v, frame)] = {hash, line.substr(used, tab - used)};
+    }
+}
+
+bool save_goldens(const std::string &path, const std::map<golden_key, golden> &goldens) {
+    FILE *f = fopen(path.c_str(), "w");
+    if (f == NULL)
+        return false;
+    fprintf(f, "# Golden screens for conform, rewritten by conform --record\n");
+    fprintf(f, "# hash\tvariant\tframe\trows\tpath\n");
+    for (const auto &g : goldens)
+        fprintf(f, "%016llx\t%s\t%lld\t%s\t%s\n", (unsigned long long)g.second.hash, variant_name((Variant)std::get<1>(g.first)),
+            std::get<2>(g.first), g.second.rows.c_str(), std::get<0>(g.first).c_str());
+    bool ok = !ferror(f);
+    return fclose(f) == 0 && ok;
+}
+
+std::string screen_rows(const chip8 &c) {
+    int rows = c.hires ? 64 : 32, words = c.hires ? 2 : 1;
+    std::string out;
+    char hex[17];
+    for (int y = 0; y < rows; y++) {
+        for (int w = 0; w < words; w++) {
+            snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)c.display[0][y][w]);
+            out += hex;
+        }
+    }
+    return out;
+}
+
+// '#' and '.' where the screen agrees with the golden one, '+' for pixels that are lit but
+// shouldn't be and '-' for ones that should be lit but aren't
+void print_diff(const std::string &now, const std::string &expected) {
+    int width = now.size() == 64*32 ? 128 : 64;
+    if (expected.size() != now.size()) {
+        printf("    expected a %s screen, got this %dx%d one:\n", expected.size() == 64*32 ? "128x64" : "64x32", width, width / 2);
+    }
+    int digits = width / 4;
+    for (size_t row = 0; row * digits < now.size(); row++) {
+        std::string line = "    ";
+        for (int d = 0; d < digits; d++) {
+            int got = std::stoi(now.substr(row * digits + d, 1), nullptr, 16);
+            int want = expected.size() == now.size() ? std::stoi(expected.substr(row * digits + d, 1), nullptr, 16) : got;
+            for (int b = 3; b >= 0; b--)
+                line += ".-+#"[((got >> b) & 1) << 1 | ((want >> b) & 1)];
+        }
+        printf("%s\n", line.c_str());
+    }
+}
+
+int main(int argc, char **argv) {
+    options opt;
+    if (!parse_args(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    std::vector<rom_spec> roms;
+    if (!load_spec(opt.spec, roms))
+        return 1;
+    std::map<golden_key, golden> goldens;
+    load_goldens(opt.golden, goldens);
+
+    int passed = 0, failed = 0, unrecorded = 0, missing = 0;
+    long long frames_run = 0;
+    // chip8 carries all of its memory inline, keep it off the stack
+    std::unique_ptr<chip8> c(new chip8());
+    auto start = std::chrono::steady_clock::now();
+    for (const rom_spec &r : roms) {
+        std::vector<BYTE> image;
+        if (!read_rom(r.path, image)) {
+            printf("skipped %s: not found\n", r.path.c_str());
+            missing++;
+            continue;
+        }
+        for (Variant v : r.variants) {
+            c->set_engine(opt.engine);
+            c->set_idle_skip(opt.idle_skip);
+            c->set_variant(v);
+            c->seed(CONFORM_SEED);
+            if (!c->load(image.data(), image.size())) {
+                printf("FAIL %-7s %s: does not fit in memory\n", variant_name(v), r.path.c_str());
+                failed++;
+                continue;
+            }
+            if (opt.record) {
+                // checks dropped from the spec go too
+                auto first = goldens.lower_bound(golden_key(r.path, v, 0));
+                auto last = goldens.lower_bound(golden_key(r.path, v + 1, 0));
+                goldens.erase(first, last);
+            }
+            size_t next_key = 0;
+            long long frame = 0;
+            for (long long check : r.checks) {
+                for (; frame < check; frame++) {
+                    for (; next_key < r.keys.size() && r.keys[next_key].frame <= frame; next_key++)
+                        for (int k = 0; k < 16; k++)
+                            c->keys[k] = (r.keys[next_key].mask >> k) & 1;
+                    c->run(r.cpf);
+                    c->tick_timers();
+                    frames_run++;
+                }
+                golden_key key(r.path, v, check);
+                golden now = {display_hash(*c), screen_rows(*c)};
+                if (opt.record) {
+                    goldens[key] = now;
+                    continue;
+                }
+                auto it = goldens.find(key);
+                if (it == goldens.end()) {
+                    printf("NEW  %-7s frame %-5lld %s: %016llx, not recorded\n", variant_name(v), check, r.path.c_str(), (unsigned long long)now.hash);
+                    unrecorded++;
+                }
+                else if (it->second.hash != now.hash) {
+                    printf("FAIL %-7s frame %-5lld %s: %016llx, expected %016llx\n", variant_name(v), check, r.path.c_str(),
+                        (unsigned long long)now.hash, (unsigned long long)it->second.hash);
+                    if (it->second.rows == now.rows)
+                        printf("    the first plane matches, the difference is in the others\n");
+                    else
+                        print_diff(now.rows, it->second.rows);
+                    failed++;
+                }
+                else {
+                    if (opt.verbose)
+                        printf("ok   %-7s frame %-5lld %s\n", variant_name(v), check, r.path.c_str());
+                    passed++;
+                }
+            }
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (opt.record) {
+        if (!save_goldens(opt.golden, goldens)) {
+            std::cerr << "Error: could not write " << opt.golden << "\n";
+            return 1;
+        }
+        printf("recorded %zu screens to %s in %.3f s\n", goldens.size(), opt.golden.c_str(), seconds);
+        return 0;
+    }
+    printf("%d passed, %d failed, %d not recorded, %d ROMs missing, %lld frames on %s in %.3f s\n",
+        passed, failed, unrecorded, missing, frames_run, engine_name(opt.engine), seconds);
+    if (passed + failed == 0)
+        std::cerr << "Error: nothing was checked\n";
+    return failed == 0 && passed > 0 ? 0 : 1;
+}
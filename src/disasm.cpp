@@ -0,0 +1,84 @@
+#include "../headers/disasm.h"
+
+#include <cstdio>
+
+std::string disassemble(WORD opcode) {
+    char text[32];
+    int x = (opcode & 0x0F00) >> 8;
+    int y = (opcode & 0x00F0) >> 4;
+    int n = opcode & 0x000F;
+    int nn = opcode & 0x00FF;
+    int nnn = opcode & 0x0FFF;
+
+    switch ((opcode & 0xF000) >> 12) {
+        case 0x0:
+            // SUPER-CHIP ones on the whole opcode, the rest on the low byte alone, same as the core does
+            if ((opcode & 0xFFF0) == 0x00C0) { snprintf(text, sizeof(text), "SCD %d", n); return text; }
+            if ((opcode & 0xFFF0) == 0x00D0) { snprintf(text, sizeof(text), "SCU %d", n); return text; }
+            if (opcode == 0x00FB)       return "SCR";
+            if (opcode == 0x00FC)       return "SCL";
+            if (opcode == 0x00FD)       return "EXIT";
+            if (opcode == 0x00FE)       return "LOW";
+            if (opcode == 0x00FF)       return "HIGH";
+            if (nn == 0xE0)             return "CLS";
+            if (nn == 0xEE)             return "RET";
+            snprintf(text, sizeof(text), "SYS 0x%03X", nnn);
+            return text;
+        case 0x1:   snprintf(text, sizeof(text), "JP 0x%03X", nnn);             return text;
+        case 0x2:   snprintf(text, sizeof(text), "CALL 0x%03X", nnn);           return text;
+        case 0x3:   snprintf(text, sizeof(text), "SE V%X, 0x%02X", x, nn);      return text;
+        case 0x4:   snprintf(text, sizeof(text), "SNE V%X, 0x%02X", x, nn);     return text;
+        case 0x5:
+            if (n == 2)     snprintf(text, sizeof(text), "SAVE V%X - V%X", x, y);
+            else if (n == 3) snprintf(text, sizeof(text), "LOAD V%X - V%X", x, y);
+            else            snprintf(text, sizeof(text), "SE V%X, V%X", x, y);
+            return text;
+        case 0x6:   snprintf(text, sizeof(text), "LD V%X, 0x%02X", x, nn);      return text;
+        case 0x7:   snprintf(text, sizeof(text), "ADD V%X, 0x%02X", x, nn);     return text;
+        case 0x8: {
+            const char *ops[16] = {"LD", "OR", "AND", "XOR", "ADD", "SUB", "SHR", "SUBN",
+                                   NULL, NULL, NULL, NULL, NULL, NULL, "SHL", NULL};
+            if (ops[n] == NULL) break;
+            snprintf(text, sizeof(text), "%s V%X, V%X", ops[n], x, y);
+            return text;
+        }
+        case 0x9:
+            snprintf(text, sizeof(text), "SNE V%X, V%X", x, y);
+            return text;
+        case 0xA:   snprintf(text, sizeof(text), "LD I, 0x%03X", nnn);          return text;
+        case 0xB:   snprintf(text, sizeof(text), "JP V0, 0x%03X", nnn);         return text;
+        case 0xC:   snprintf(text, sizeof(text), "RND V%X, 0x%02X", x, nn);     return text;
+        case 0xD:   snprintf(text, sizeof(text), "DRW V%X, V%X, %d", x, y, n);  return text;
+        case 0xE:
+            if (nn == 0x9E) { snprintf(text, sizeof(text), "SKP V%X", x);       return text; }
+            if (nn == 0xA1) { snprintf(text, sizeof(text), "SKNP V%X", x);      return text; }
+            break;
+        case 0xF: {
+            // the address of LD I, long is in the next two bytes, which aren't passed in
+            if (opcode == 0xF000)       return "LD I, long";
+            if (opcode == 0xF002)       return "AUDIO";
+            if (nn == 0x01) { snprintf(text, sizeof(text), "PLANE %d", x); return text; }
+            const char *format = NULL;
+            switch (nn) {
+                case 0x07:  format = "LD V%X, DT";      break;
+                case 0x0A:  format = "LD V%X, K";       break;
+                case 0x15:  format = "LD DT, V%X";      break;
+                case 0x18:  format = "LD ST, V%X";      break;
+                case 0x1E:  format = "ADD I, V%X";      break;
+                case 0x29:  format = "LD F, V%X";       break;
+                case 0x33:  format = "LD B, V%X";       break;
+                case 0x55:  format = "LD [I], V%X";     break;
+                case 0x65:  format = "LD V%X, [I]";     break;
+                case 0x30:  format = "LD HF, V%X";      break;
+                case 0x75:  format = "LD R, V%X";       break;
+                case 0x85:  format = "LD V%X, R";       break;
+                case 0x3A:  format = "PITCH V%X";       break;
+            }
+            if (format == NULL) break;
+            snprintf(text, sizeof(text), format, x);
+            return text;
+        }
+    }
+    snprintf(text, sizeof(text), "DW 0x%04X", opcode);
+    return text;
+}
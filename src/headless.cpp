@@ -0,0 +1,352 @@
+#include "../headers/chip8.h"
+#include "../headers/aot.h"
+#include "../headers/thread_pool.h"
+#include "../headers/tools.h"
+#include "../headers/movie.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <memory>
+#include <ctime>
+
+/* Headless batch runner
+Runs many CHIP-8 instances at once without SDL, spread over every core through the
+work-stealing pool. Each instance runs a fixed number of frames (cycles per frame
+followed by one 60 Hz timer tick) and reports a hash of its display, so soak and
+regression runs can happen on build boxes with no display.
+
+Usage: headless [options] [rom ...]
+    -n, --instances N   instances per ROM (default 1)
+    -f, --frames N      frames to run per instance (default 600)
+    -c, --cycles N      cycles to run per instance, overrides --frames
+    --cpf N             cycles per frame (default 11, same as the SDL frontend)
+    -j, --threads N     worker threads (default: all cores)
+    -e, --engine NAME   interpreter, threaded, jit or aot (default: threaded where supported)
+    -s, --seed N        random seed, instance n of each ROM uses N + n (default: the clock)
+    -q, --variant NAME  run every ROM with the quirks of default, vip, chip48, schip or xochip
+                        (default: the profile the ROM library has for it)
+    --no-idle-skip      execute idle loops and key waits instruction by instruction
+    --verify-engines    run every ROM on all engines in lockstep and compare state each frame
+    -t, --trace LEVEL   trace level for the core: off, error, warn or info (default warn)
+    --trace-dir DIR     save the trace of every instance that logged something to DIR
+    --replay FILE       play an input movie on the one ROM given, as fast as possible
+    --hash-every N      while replaying, print the screen hash every N frames (default 60)
+    -v, --verbose       print one line per instance
+ROMs can be paths, numbers, hashes or names from the ROM library, with none given every
+ROM in it is used. Built with -DCHIP8_PROFILE, the first instance of each ROM also prints
+its profile.
+*/
+
+struct options {
+    int instances = 1;
+    long long frames = 600;
+    long long cycles = -1;
+    int cpf = 700/60;
+    unsigned threads = std::thread::hardware_concurrency();
+    Engine engine = CHIP8_HAS_THREADED ? ENGINE_THREADED : ENGINE_INTERPRETER;
+    uint64_t seed = (uint64_t)time(0);
+    bool idle_skip = true;
+    bool verify_engines = false;
+    bool verbose = false;
+    int trace_level = TRACE_WARN;
+    std::string trace_dir;
+    std::string replay;
+    int hash_every = 60;
+    bool force_variant = false;
+    Variant variant = VARIANT_DEFAULT;
+    std::vector<std::string> roms;
+    std::vector<Variant> variants; // one per ROM
+};
+
+struct result {
+    size_t rom;
+    int instance;
+    long long cycles;
+    uint64_t skipped;   // of those cycles, how many idle skip fast forwarded
+    uint64_t hash;
+    size_t traced;      // records in the instance's trace ring
+#ifdef CHIP8_PROFILE
+    std::string profile; // instance 0 of each ROM only
+#endif
+};
+
+void usage() {
+    std::cerr << "Usage: headless [-n instances] [-f frames | -c cycles] [--cpf N] [-j threads] [-e engine] [-q variant] [-s seed] [--no-idle-skip] [--verify-engines] [-t level] [--trace-dir dir] [--replay movie [--hash-every N]] [-v] [rom ...]\n";
+}
+
+bool parse_args(int argc, char **argv, options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if ((arg == "-n" || arg == "--instances") && has_value)     opt.instances = std::stoi(argv[++i]);
+        else if ((arg == "-f" || arg == "--frames") && has_value)   opt.frames = std::stoll(argv[++i]);
+        else if ((arg == "-c" || arg == "--cycles") && has_value)   opt.cycles = std::stoll(argv[++i]);
+        else if (arg == "--cpf" && has_value)                       opt.cpf = std::stoi(argv[++i]);
+        else if ((arg == "-j" || arg == "--threads") && has_value)  opt.threads = std::stoi(argv[++i]);
+        else if ((arg == "-e" || arg == "--engine") && has_value) {
+            std::string name = argv[++i];
+            if (!parse_engine(name, opt.engine)) {
+                std::cerr << "Error: unknown engine " << name << "\n";
+                return false;
+            }
+        }
+        else if ((arg == "-q" || arg == "--variant") && has_value) {
+            if (!parse_variant(argv[++i], opt.variant)) {
+                std::cerr << "Error: unknown variant " << argv[i] << "\n";
+                return false;
+            }
+            opt.force_variant = true;
+        }
+        else if ((arg == "-s" || arg == "--seed") && has_value)     opt.seed = std::stoull(argv[++i]);
+        else if (arg == "--no-idle-skip")                           opt.idle_skip = false;
+        else if (arg == "--verify-engines")                         opt.verify_engines = true;
+        else if ((arg == "-t" || arg == "--trace") && has_value) {
+            if (!parse_trace_level(argv[++i], opt.trace_level)) {
+                std::cerr << "Error: unknown trace level " << argv[i] << "\n";
+                return false;
+            }
+        }
+        else if (arg == "--trace-dir" && has_value)                 opt.trace_dir = argv[++i];
+        else if (arg == "--replay" && has_value)                    opt.replay = argv[++i];
+        else if (arg == "--hash-every" && has_value)                opt.hash_every = std::stoi(argv[++i]);
+        else if (arg == "-v" || arg == "--verbose")                 opt.verbose = true;
+        else if (arg == "-h" || arg == "--help")                    return false;
+        else if (!arg.empty() && arg[0] == '-') {
+            std::cerr << "Error: unknown option " << arg << "\n";
+            return false;
+        }
+        else opt.roms.push_back(arg);
+    }
+    return opt.instances > 0 && opt.cpf > 0 && opt.hash_every > 0;
+}
+
+// Runs each ROM on the interpreter and every other engine this build has, side by side, and
+// stops at the first frame where any register, memory, timer or display state differs. Both
+// copies get the same seed, so CXNN agrees too, and every ROM and engine pair is its own job
+// on the pool. The reference never skips idle loops, so the interpreter is checked against
+// itself with skipping on as well.
+int verify_engines(const options &opt, const std::vector<std::vector<BYTE>> &images) {
+    std::vector<Engine> engines;
+    if (opt.idle_skip)
+        engines.push_back(ENGINE_INTERPRETER);
+    if (CHIP8_HAS_THREADED)
+        engines.push_back(ENGINE_THREADED);
+    if (CHIP8_HAS_JIT)
+        engines.push_back(ENGINE_JIT);
+    if (!aot_programs().empty())
+        engines.push_back(ENGINE_AOT);
+    if (engines.empty()) {
+        std::cerr << "Error: this build has only the interpreter, nothing to compare against\n";
+        return 1;
+    }
+
+    long long frames = opt.cycles >= 0 ? (opt.cycles + opt.cpf - 1) / opt.cpf : opt.frames;
+    // frame the pair diverged at, frames if it never did, -1 if the ROM doesn't fit, -2 if the engine is missing
+    std::vector<long long> diverged(images.size() * engines.size());
+    thread_pool pool(opt.threads);
+    for (size_t r = 0; r < images.size(); r++) {
+        for (size_t e = 0; e < engines.size(); e++) {
+            long long *out = &diverged[r * engines.size() + e];
+            const std::vector<BYTE> *image = &images[r];
+            Engine engine = engines[e];
+            pool.submit([=, &opt] {
+                std::unique_ptr<chip8> a(new chip8()), b(new chip8());
+                a->set_engine(ENGINE_INTERPRETER);
+                a->set_idle_skip(false);
+                a->set_variant(opt.variants[r]);
+                b->set_engine(engine);
+                b->set_idle_skip(opt.idle_skip);
+                b->set_variant(opt.variants[r]);
+                if (b->get_engine() != engine) {
+                    *out = -2;
+                    return;
+                }
+                a->seed(opt.seed + r);
+                b->seed(opt.seed + r);
+                if (!a->load(image->data(), image->size()) || !b->load(image->data(), image->size())) {
+                    *out = -1;
+                    return;
+                }
+                long long frame = 0;
+                for (; frame < frames; frame++) {
+                    a->run(opt.cpf);
+                    a->tick_timers();
+                    b->run(opt.cpf);
+                    b->tick_timers();
+                    if (!a->same_state(*b))
+                        break;
+                }
+                *out = frame;
+            });
+        }
+    }
+    pool.wait();
+
+    int failures = 0;
+    for (size_t r = 0; r < images.size(); r++) {
+        for (size_t e = 0; e < engines.size(); e++) {
+            long long frame = diverged[r * engines.size() + e];
+            std::string name = engine_name(engines[e]);
+            if (opt.idle_skip)
+                name += " with idle skip";
+            if (frame == -1) {
+                printf("%s: too large to fit in memory\n", opt.roms[r].c_str());
+                break;
+            }
+            if (frame == -2)
+                printf("%s: %s engine unavailable at run time\n", opt.roms[r].c_str(), engine_name(engines[e]));
+            else if (frame < frames) {
+                printf("%s: interpreter and %s diverge at frame %lld\n", opt.roms[r].c_str(), name.c_str(), frame);
+                failures++;
+            }
+            else
+                printf("%s: interpreter and %s match for %lld frames\n", opt.roms[r].c_str(), name.c_str(), frames);
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+// Plays a movie on one machine with nothing but the CPU to hold it back, printing the screen
+// hash every so many frames so two runs (or two builds) can be diffed line by line
+int replay(const options &opt, const std::vector<std::vector<BYTE>> &images) {
+    if (images.size() != 1) {
+        std::cerr << "Error: --replay takes exactly one ROM\n";
+        return 1;
+    }
+    movie film;
+    if (!film.load(opt.replay)) {
+        std::cerr << "Error: " << opt.replay << " is not a movie file\n";
+        return 1;
+    }
+    std::unique_ptr<chip8> c(new chip8());
+    c->set_engine(opt.engine);
+    c->set_idle_skip(opt.idle_skip);
+    c->trace.level = opt.trace_level;
+    c->seed(film.seed());
+    if (!c->load(images[0].data(), images[0].size()) || !film.start(*c)) {
+        std::cerr << "Error: " << opt.replay << " was recorded with a different ROM\n";
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    while (film.play_frame(*c)) {
+        if (film.frame() % opt.hash_every == 0 || film.finished())
+            printf("frame %u hash=%016llx\n", film.frame(), (unsigned long long)display_hash(*c));
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%u of %u frames in %.3f s (%.0fx real time), seed %llu\n", film.frame(), film.frames(), seconds,
+        film.frame() / 60.0 / (seconds > 0 ? seconds : 1e-9), (unsigned long long)film.seed());
+    return film.frame() == film.frames() ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    options opt;
+    if (!parse_args(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    if (!resolve_roms(opt.roms, opt.variants))
+        return 1;
+    if (opt.force_variant)
+        opt.variants.assign(opt.roms.size(), opt.variant);
+
+    // Every ROM is read once, all of its instances load from the same buffer
+    std::vector<std::vector<BYTE>> images(opt.roms.size());
+    for (size_t r = 0; r < opt.roms.size(); r++) {
+        if (!read_rom(opt.roms[r], images[r])) {
+            std::cerr << "Error: could not read " << opt.roms[r] << "\n";
+            return 1;
+        }
+    }
+
+    if (opt.verify_engines)
+        return verify_engines(opt, images);
+    if (!opt.replay.empty())
+        return replay(opt, images);
+
+    long long total_cycles = opt.cycles >= 0 ? opt.cycles : opt.frames * opt.cpf;
+    std::vector<result> results(opt.roms.size() * opt.instances);
+    thread_pool pool(opt.threads);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < opt.roms.size(); r++) {
+        for (int n = 0; n < opt.instances; n++) {
+            result *out = &results[r * opt.instances + n];
+            const std::vector<BYTE> *image = &images[r];
+            pool.submit([=, &opt] {
+                // chip8 is about 140 KB, 64 KB of memory and a cached decode for every byte of
+                // code all inline, keep it off the worker's stack
+                std::unique_ptr<chip8> c(new chip8());
+                c->set_engine(opt.engine);
+                c->set_idle_skip(opt.idle_skip);
+                c->set_variant(opt.variants[r]);
+                c->seed(opt.seed + n);
+                c->trace.level = opt.trace_level;
+                out->rom = r;
+                out->instance = n;
+                out->cycles = 0;
+                out->skipped = 0;
+                out->traced = 0;
+                if (!c->load(image->data(), image->size())) {
+                    out->hash = 0;
+                    return;
+                }
+                long long remaining = total_cycles;
+                {
+                    PROFILE_SCOPE(c->profile, PROF_EMULATE);
+                    while (remaining > 0) {
+                        int batch = remaining < opt.cpf ? (int)remaining : opt.cpf;
+                        c->run(batch);
+                        c->tick_timers();
+                        remaining -= batch;
+                    }
+                }
+                out->cycles = total_cycles;
+                out->skipped = c->skipped_cycles;
+                out->traced = c->trace.records().size();
+                if (out->traced && !opt.trace_dir.empty()) {
+                    std::string name = opt.roms[r].substr(opt.roms[r].find_last_of("/\\") + 1);
+                    c->trace.save(opt.trace_dir + "/" + name + "." + std::to_string(n) + ".trace");
+                }
+                out->hash = display_hash(*c);
+#ifdef CHIP8_PROFILE
+                if (n == 0)
+                    out->profile = c->profile.report(c->state().memory);
+#endif
+            });
+        }
+    }
+    pool.wait();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Per ROM summary: how many distinct screens its instances ended on
+    long long executed = 0;
+    for (size_t r = 0; r < opt.roms.size(); r++) {
+        std::vector<uint64_t> hashes;
+        for (int n = 0; n < opt.instances; n++) {
+            const result &res = results[r * opt.instances + n];
+            executed += res.cycles;
+            if (opt.verbose)
+                printf("%s #%d cycles=%lld skipped=%llu traced=%zu hash=%016llx\n", opt.roms[r].c_str(), n, res.cycles,
+                    (unsigned long long)res.skipped, res.traced, (unsigned long long)res.hash);
+            if (std::find(hashes.begin(), hashes.end(), res.hash) == hashes.end())
+                hashes.push_back(res.hash);
+        }
+        if (images[r].size() > MAX_ROM_SIZE)
+            printf("%s: too large to fit in memory\n", opt.roms[r].c_str());
+        else
+            printf("%s: %d instances, %zu distinct screens\n", opt.roms[r].c_str(), opt.instances, hashes.size());
+#ifdef CHIP8_PROFILE
+        printf("%s", results[r * opt.instances].profile.c_str());
+#endif
+    }
+
+    printf("%lld cycles on %zu threads in %.3f s (%.1f M cycles/s, %zu steals), seed %llu\n",
+        executed, pool.size(), seconds, executed / seconds / 1e6, pool.steals.load(), (unsigned long long)opt.seed);
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include "../headers/input.h"
+
+#include <cstdio>
+
+/* Keyboard
+    1	2	3	C
+    4	5	6	D
+    7	8	9	E
+    A	0	B	F
+*/
+static int keypad_index(SDL_Keycode sym) {
+    switch (sym) {
+        case SDLK_x:    return 0x0;
+        case SDLK_1:    return 0x1;
+        case SDLK_2:    return 0x2;
+        case SDLK_3:    return 0x3;
+        case SDLK_q:    return 0x4;
+        case SDLK_w:    return 0x5;
+        case SDLK_e:    return 0x6;
+        case SDLK_a:    return 0x7;
+        case SDLK_s:    return 0x8;
+        case SDLK_d:    return 0x9;
+        case SDLK_z:    return 0xA;
+        case SDLK_c:    return 0xB;
+        case SDLK_4:    return 0xC;
+        case SDLK_r:    return 0xD;
+        case SDLK_f:    return 0xE;
+        case SDLK_v:    return 0xF;
+        default:        return -1;
+    }
+}
+
+input::input() {
+    freq = (double)SDL_GetPerformanceFrequency();
+}
+
+void input::poll() {
+    events.clear();
+    keys.clear();
+    Uint64 now = SDL_GetPerformanceCounter();
+    Uint32 ticks = SDL_GetTicks();
+    SDL_Event event;
+    while (SDL_PollEvent(&event)) {
+        bool is_key = event.type == SDL_KEYDOWN || event.type == SDL_KEYUP;
+        int key = is_key ? keypad_index(event.key.keysym.sym) : -1;
+        if (key < 0) {
+            events.push_back(event);
+            continue;
+        }
+        // Held keys repeat, the keypad only cares about the first press
+        if (event.key.repeat)
+            continue;
+        // SDL stamps events in milliseconds when they were queued, move that onto the fine clock
+        Uint32 age = ticks - event.key.timestamp;
+        Uint64 back = (Uint64)(age / 1000.0 * freq);
+        Uint64 stamp = back < now ? now - back : 0;
+        if (!sent.empty() && stamp < sent.back())
+            stamp = sent.back();
+        keys.push_back({stamp, (BYTE)key, event.type == SDL_KEYDOWN});
+        sent.push_back(stamp);
+    }
+}
+
+// Called right after a frame went to the screen, with the keypad totals the frame was made with
+void input::presented(Uint64 now, uint64_t delivered_total, double delivered_delay) {
+    delivered = delivered_total;
+    delay = delivered_delay;
+    for (; sent_first < delivered_total && !sent.empty(); sent_first++) {
+        double latency = now > sent.front() ? (now - sent.front()) / freq : 0;
+        sent.pop_front();
+        changes++;
+        latency_sum += latency;
+        if (latency > latency_worst)
+            latency_worst = latency;
+    }
+}
+
+std::string input::report() const {
+    if (changes == 0)
+        return "Input: no key changes yet\n";
+    double to_core = (delay - base_delay) / (delivered > base_delivered ? delivered - base_delivered : 1);
+    char line[256];
+    snprintf(line, sizeof(line),
+        "Input: %llu key changes, %.2f ms to the core and %.2f ms to the screen on average, %.2f ms at worst\n",
+        (unsigned long long)changes, to_core * 1e3, latency_sum / changes * 1e3, latency_worst * 1e3);
+    return line;
+}
+
+void input::clear_stats() {
+    changes = 0;
+    base_delivered = delivered;
+    base_delay = delay;
+    latency_sum = latency_worst = 0;
+}
+
+keypad::keypad() {
+    freq = (double)SDL_GetPerformanceFrequency();
+}
+
+// Hands the core the changes that happened up to `until`, then the whole keypad. A key changes
+// at most once per delivery, so a press and its release always go to different batches.
+void keypad::deliver(chip8 &c, Uint64 until) {
+    size_t n = 0;
+    if (!queue.empty()) {
+        Uint64 now = SDL_GetPerformanceCounter();
+        uint16_t changed = 0;
+        for (; n < queue.size() && queue[n].stamp <= until; n++) {
+            const key_event &e = queue[n];
+            if (changed & (1 << e.key))
+                break;
+            changed |= 1 << e.key;
+            held[e.key] = e.down;
+            delivered++;
+            delivered_delay += now > e.stamp ? (now - e.stamp) / freq : 0;
+        }
+        queue.erase(queue.begin(), queue.begin() + n);
+    }
+    for (int i = 0; i < 16; i++)
+        c.keys[i] = held[i];
+}
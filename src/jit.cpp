@@ -0,0 +1,287 @@
+#include "../headers/jit.h"
+
+#if CHIP8_HAS_JIT
+
+#include <sys/mman.h>
+#include <cstdint>
+
+// Appends x86-64 machine code to the block being built. Every CHIP-8 field lives at
+// a fixed offset from the chip8 object, which is kept in rbx for the whole block.
+struct emitter {
+    BYTE *p;
+
+    void byte(BYTE b) { *p++ = b; }
+    void word(WORD w) { memcpy(p, &w, 2); p += 2; }
+    void dword(uint32_t d) { memcpy(p, &d, 4); p += 4; }
+    void qword(uint64_t q) { memcpy(p, &q, 8); p += 8; }
+
+    // ModRM for [rbx + disp32] with reg in the middle field
+    void mem(int reg, int32_t disp) { byte(0x80 | (reg << 3) | 3); dword((uint32_t)disp); }
+
+    void movzx_eax(int32_t disp)        { byte(0x0F); byte(0xB6); mem(0, disp); }   // movzx eax, byte [rbx+disp]
+    void mov_store_al(int32_t disp)     { byte(0x88); mem(0, disp); }               // mov byte [rbx+disp], al
+    void mov_store_cl(int32_t disp)     { byte(0x88); mem(1, disp); }               // mov byte [rbx+disp], cl
+    void mov_imm8(int32_t disp, BYTE v) { byte(0xC6); mem(0, disp); byte(v); }      // mov byte [rbx+disp], imm8
+    void add_imm8(int32_t disp, BYTE v) { byte(0x80); mem(0, disp); byte(v); }      // add byte [rbx+disp], imm8
+    void cmp_imm8(int32_t disp, BYTE v) { byte(0x80); mem(7, disp); byte(v); }      // cmp byte [rbx+disp], imm8
+    void alu_store_al(BYTE opc, int32_t disp) { byte(opc); mem(0, disp); }          // op byte [rbx+disp], al
+    void alu_load_al(BYTE opc, int32_t disp)  { byte(opc); mem(0, disp); }          // op al, byte [rbx+disp]
+    void setcc(BYTE cc, int32_t disp)   { byte(0x0F); byte(cc); mem(0, disp); }     // setcc byte [rbx+disp]
+    void mov_word_imm(int32_t disp, WORD v) { byte(0x66); byte(0xC7); mem(0, disp); word(v); } // mov word [rbx+disp], imm16
+    void add_word_ax(int32_t disp)      { byte(0x66); byte(0x01); mem(0, disp); }   // add word [rbx+disp], ax
+    void mov_word_ax(int32_t disp)      { byte(0x66); byte(0x89); mem(0, disp); }   // mov word [rbx+disp], ax
+
+    void prologue() { byte(0x53); byte(0x48); byte(0x89); byte(0xFB); }             // push rbx; mov rbx, rdi
+    void epilogue() { byte(0x5B); byte(0xC3); }                                     // pop rbx; ret
+
+    // fn(c, op) through rax, same calling convention as the interpreter's cache entries
+    void call_handler(uint64_t fn, uint64_t op) {
+        byte(0x48); byte(0x89); byte(0xDF);                                         // mov rdi, rbx
+        byte(0x48); byte(0xBE); qword(op);                                          // mov rsi, imm64
+        byte(0x48); byte(0xB8); qword(fn);                                          // mov rax, imm64
+        byte(0xFF); byte(0xD0);                                                     // call rax
+    }
+};
+
+// Longest code any single instruction emits, checked before emitting so the buffer can't overrun
+static const size_t MAX_INSTR_BYTES = 64;
+
+jit::jit(chip8 &owner) : c(owner) {
+    void *mem = mmap(nullptr, BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED)
+        buffer = (BYTE *)mem;
+}
+
+jit::~jit() {
+    if (buffer)
+        munmap(buffer, BUFFER_SIZE);
+}
+
+// Forget every block and start filling the buffer from the beginning again
+void jit::flush() {
+    blocks.clear();
+    memset(entry, 0, sizeof(entry));
+    memset(covered, 0, sizeof(covered));
+    memset(rewrites, 0, sizeof(rewrites));
+    used = 0;
+}
+
+void jit::drop(block *b) {
+    entry[b->start] = nullptr;
+    if (rewrites[b->start] < SMC_LIMIT)
+        rewrites[b->start]++;
+    for (int i = 0; i < b->bytes; i++)
+        covered[(b->start + i) & 0xFFF]--;
+}
+
+// A write landed on translated code. The code itself stays in the buffer until the next
+// flush, so a block that invalidates itself can still return safely.
+void jit::invalidate(WORD addr) {
+    addr &= 0xFFF;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        block *b = blocks[i].get();
+        if (entry[b->start] != b)
+            continue;
+        if (addr >= b->start && addr < b->start + b->bytes)
+            drop(b);
+    }
+    // Dead blocks only need their ops kept alive until the running block returns, which it
+    // has by the time anything calls compile() again, so they are swept there
+}
+
+jit::block *jit::compile(WORD addr) {
+    // Sweep blocks that were invalidated since the last compile
+    size_t live = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (entry[blocks[i]->start] == blocks[i].get())
+            blocks[live++] = std::move(blocks[i]);
+    }
+    blocks.resize(live);
+
+    if (used + MAX_BLOCK * MAX_INSTR_BYTES + 16 > BUFFER_SIZE)
+        flush();
+
+    std::unique_ptr<block> b(new block());
+    b->start = addr;
+    b->ops.reserve(MAX_BLOCK);
+
+    emitter e { buffer + used };
+    b->code = (block_fn)e.p;
+    e.prologue();
+
+    const int32_t R = (int32_t)((BYTE *)c.registers - (BYTE *)&c);
+    const int32_t PC = (int32_t)((BYTE *)&c.pc - (BYTE *)&c);
+    const int32_t IR = (int32_t)((BYTE *)&c.I - (BYTE *)&c);
+    const int32_t DT = (int32_t)((BYTE *)&c.delay_timer - (BYTE *)&c);
+    const int32_t ST = (int32_t)((BYTE *)&c.sound_timer - (BYTE *)&c);
+    const int32_t VF_ = R + VF;
+    // The variant was fixed when the buffer was last flushed, so its quirks are just constants here
+    const quirk_flags q = c.quirks;
+    auto vf_reset = [&] { if (q.vf_reset) e.mov_imm8(VF_, 0); };
+
+    WORD a = addr;
+    bool ended = false;
+    int peeked = 0; // bytes past the block whose contents the code depends on
+    while (!ended && b->count < MAX_BLOCK && a + 1 <= 0xFFF) {
+        chip8::instr op = c.decode(c.fetch(a));
+        const int32_t RX = R + op.x, RY = R + op.y;
+        const int32_t SHIFTED = q.shift_vy ? RY : RX; // 8XY6 and 8XYE read this one
+        WORD next = a + 2;
+        b->count++;
+        b->last = a;
+        b->last_kind = op.kind;
+
+        switch (op.kind) {
+            case OPC_0NNN:                                                              break;
+            case OPC_6XNN:  e.mov_imm8(RX, op.nn);                                      break;
+            case OPC_7XNN:  e.add_imm8(RX, op.nn);                                      break;
+            case OPC_8XY0:  e.movzx_eax(RY); e.mov_store_al(RX);                        break;
+            case OPC_8XY1:  e.movzx_eax(RY); e.alu_store_al(0x08, RX); vf_reset();      break;  // or
+            case OPC_8XY2:  e.movzx_eax(RY); e.alu_store_al(0x20, RX); vf_reset();      break;  // and
+            case OPC_8XY3:  e.movzx_eax(RY); e.alu_store_al(0x30, RX); vf_reset();      break;  // xor
+            case OPC_8XY4:
+                // The handler resets VF before testing for carry and adds afterwards, so when
+                // X or Y is F both the test and the add see the updated VF. Same order here.
+                e.mov_imm8(VF_, 0);
+                e.movzx_eax(RX); e.alu_load_al(0x02, RY); e.setcc(0x92, VF_);           // add al, vy; setc vf
+                e.movzx_eax(RY); e.alu_store_al(0x00, RX);                              // add vx, al
+                break;
+            case OPC_8XY5:
+                e.mov_imm8(VF_, 1);
+                e.movzx_eax(RX); e.alu_load_al(0x3A, RY); e.setcc(0x93, VF_);           // cmp al, vy; setae vf
+                e.movzx_eax(RY); e.alu_store_al(0x28, RX);                              // sub vx, al
+                break;
+            case OPC_8XY6:
+                e.movzx_eax(SHIFTED);
+                e.byte(0x89); e.byte(0xC1);                                             // mov ecx, eax
+                e.byte(0x83); e.byte(0xE1); e.byte(0x01);                               // and ecx, 1
+                e.byte(0xD0); e.byte(0xE8);                                             // shr al, 1
+                e.mov_store_al(RX); e.mov_store_cl(VF_);
+                break;
+            case OPC_8XY7:
+                e.mov_imm8(VF_, 1);
+                e.movzx_eax(RY); e.alu_load_al(0x3A, RX); e.setcc(0x93, VF_);           // cmp al, vx; setae vf
+                e.movzx_eax(RY); e.alu_load_al(0x2A, RX); e.mov_store_al(RX);           // sub al, vx
+                break;
+            case OPC_8XYE:
+                e.movzx_eax(SHIFTED);
+                e.byte(0x89); e.byte(0xC1);                                             // mov ecx, eax
+                e.byte(0xC1); e.byte(0xE9); e.byte(0x07);                               // shr ecx, 7
+                e.byte(0x00); e.byte(0xC0);                                             // add al, al
+                e.mov_store_al(RX); e.mov_store_cl(VF_);
+                break;
+            case OPC_ANNN:  e.mov_word_imm(IR, op.nnn);                                 break;
+            case OPC_FX07:  e.movzx_eax(DT); e.mov_store_al(RX);                        break;
+            case OPC_FX15:  e.movzx_eax(RX); e.mov_store_al(DT);                        break;
+            case OPC_FX18:  e.movzx_eax(RX); e.mov_store_al(ST);                        break;
+            case OPC_FX1E:  e.movzx_eax(RX); e.add_word_ax(IR);                         break;
+            case OPC_FX29:
+                e.movzx_eax(RX);
+                e.byte(0x8D); e.byte(0x04); e.byte(0x80);                               // lea eax, [rax+rax*4]
+                e.mov_word_ax(IR);
+                break;
+
+            case OPC_1NNN:
+                e.mov_word_imm(PC, op.nnn);
+                ended = true;
+                break;
+
+            // Skips: pc = next, then next + 2 if the condition holds. On XO-CHIP it is next + 4
+            // over an F000 NNNN, and the block has to cover the instruction it looked at.
+            case OPC_3XNN:
+            case OPC_4XNN:
+            case OPC_5XY0:
+            case OPC_9XY0: {
+                int over = 2;
+                if (q.xochip) {
+                    over = c.fetch(next) == 0xF000 ? 4 : 2;
+                    peeked = 2;
+                }
+                e.mov_word_imm(PC, next);
+                if (op.kind == OPC_3XNN || op.kind == OPC_4XNN)
+                    e.cmp_imm8(RX, op.nn);
+                else {
+                    e.movzx_eax(RX); e.alu_load_al(0x3A, RY);                          // cmp al, vy
+                }
+                bool skip_if_equal = op.kind == OPC_3XNN || op.kind == OPC_5XY0;
+                e.byte(skip_if_equal ? 0x75 : 0x74); e.byte(9);                         // jne/je over the store
+                e.mov_word_imm(PC, next + over);
+                ended = true;
+                break;
+            }
+
+            // Everything else runs the interpreter's handler with pc already past the instruction
+            default:
+                b->ops.push_back(op);
+                e.mov_word_imm(PC, next);
+                e.call_handler((uint64_t)(uintptr_t)op.fn, (uint64_t)(uintptr_t)&b->ops.back());
+                switch (op.kind) {
+                    case OPC_00EE: case OPC_2NNN: case OPC_BNNN: case OPC_EX9E: case OPC_EXA1:
+                    case OPC_DXYN: case OPC_FX0A: case OPC_FX33: case OPC_FX55: case OPC_INVALID:
+                    case OPC_DXY0: case OPC_00FD: case OPC_F000: case OPC_5XY2:
+                        ended = true;
+                        break;
+                    default:
+                        break;
+                }
+                break;
+        }
+        a = next;
+    }
+
+    // Ran out of room or instructions: leave pc on the first instruction not translated
+    if (!ended)
+        e.mov_word_imm(PC, a);
+    e.epilogue();
+
+    b->bytes = a - addr + peeked;
+    used = e.p - buffer;
+    for (int i = 0; i < b->bytes; i++)
+        covered[(addr + i) & 0xFFF]++;
+    entry[addr] = b.get();
+    blocks.push_back(std::move(b));
+    return entry[addr];
+}
+
+void jit::run(int cycles) {
+    while (cycles > 0) {
+        // pc past the end of memory (BNNN can get there) is left to the interpreter's masking
+        if (c.pc > 0xFFE) {
+            c.cycle();
+            cycles--;
+            continue;
+        }
+
+        block *b = entry[c.pc];
+        if (b == nullptr && rewrites[c.pc] < SMC_LIMIT)
+            b = compile(c.pc);
+
+        // Self-modifying code, or not enough cycles left for the whole block: take one
+        // instruction at a time on the interpreter
+        if (b == nullptr || b->count > cycles) {
+            c.cycle();
+            cycles--;
+            continue;
+        }
+
+        b->code(&c);
+        cycles -= b->count;
+        if (b->last_kind == OPC_1NNN && c.pc <= b->last)
+            cycles = c.idle_skip(b->last, cycles);
+        else if ((b->last_kind == OPC_FX0A || b->last_kind == OPC_00FD) && c.pc == b->last)
+            cycles = c.idle_wait(cycles);
+    }
+}
+
+#else
+
+// Builds without a JIT still link, chip8::set_engine() never creates one
+jit::jit(chip8 &owner) : c(owner) {}
+jit::~jit() {}
+void jit::flush() {}
+void jit::drop(block *b) {}
+void jit::invalidate(WORD addr) {}
+jit::block *jit::compile(WORD addr) { return nullptr; }
+void jit::run(int cycles) { c.run(cycles); }
+
+#endif
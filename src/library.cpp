@@ -0,0 +1,335 @@
+#include "../headers/library.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <set>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+static const char *const ROM_EXTENSIONS[] = {".ch8", ".c8", ".sc8", ".xo8"};
+
+bool rom_file::open(const std::string &path) {
+    close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+        // The view keeps the file open on its own, both handles can go straight away
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping != NULL) {
+            void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+            if (view != NULL) {
+                bytes = (const BYTE *)view;
+                length = (size_t)size.QuadPart;
+                mapped = true;
+            }
+        }
+    }
+    CloseHandle(file);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view != MAP_FAILED) {
+            bytes = (const BYTE *)view;
+            length = (size_t)st.st_size;
+            mapped = true;
+        }
+    }
+    ::close(fd);
+#endif
+    if (mapped)
+        return true;
+
+    // Empty files can't be mapped, and some file systems won't, so read it the plain way
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL)
+        return false;
+    BYTE buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        copy.insert(copy.end(), buffer, buffer + n);
+    bool ok = !ferror(f);
+    fclose(f);
+    if (!ok) {
+        copy.clear();
+        return false;
+    }
+    bytes = copy.data();
+    length = copy.size();
+    return true;
+}
+
+void rom_file::close() {
+    if (mapped) {
+#ifdef _WIN32
+        UnmapViewOfFile(bytes);
+#else
+        munmap((void *)bytes, length);
+#endif
+    }
+    copy.clear();
+    bytes = nullptr;
+    length = 0;
+    mapped = false;
+}
+
+std::string hash_string(uint64_t hash) {
+    char text[17];
+    snprintf(text, sizeof(text), "%016llx", (unsigned long long)hash);
+    return text;
+}
+
+Variant rom_variant(const rom_entry &e) {
+    Variant v = VARIANT_DEFAULT;
+    if (!parse_variant(e.profile, v))
+        std::cerr << "Warning: unknown profile \"" << e.profile << "\" for " << e.path << ", using default\n";
+    return v;
+}
+
+static std::string lower(std::string s) {
+    for (char &ch : s)
+        ch = (char)std::tolower((unsigned char)ch);
+    return s;
+}
+
+static bool is_rom(const fs::path &p) {
+    std::string ext = lower(p.extension().string());
+    for (const char *rom_ext : ROM_EXTENSIONS)
+        if (ext == rom_ext)
+            return true;
+    return false;
+}
+
+// Until someone edits the index, the extension is the best guess there is
+static std::string guess_profile(const fs::path &p) {
+    std::string ext = lower(p.extension().string());
+    if (ext == ".sc8")  return variant_name(VARIANT_SCHIP);
+    if (ext == ".xo8")  return variant_name(VARIANT_XOCHIP);
+    return variant_name(VARIANT_DEFAULT);
+}
+
+bool rom_library::open(const std::string &path) {
+    index_path = path;
+    entries.clear();
+    changed = false;
+    std::ifstream index(path);
+    if (!index.is_open())
+        return true;
+    std::string line;
+    while (std::getline(index, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        // hash, profile, size, mtime, then the path, which may have spaces but never a tab
+        rom_entry e;
+        char profile[64];
+        unsigned long long hash, size;
+        long long mtime;
+        int used = 0;
+        if (sscanf(line.c_str(), "%16llx\t%63[^\t]\t%llu\t%lld\t%n", &hash, profile, &size, &mtime, &used) != 4 || used == 0)
+            continue;
+        e.path = line.substr(used);
+        if (e.path.empty())
+            continue;
+        e.name = fs::path(e.path).stem().string();
+        e.profile = profile;
+        e.hash = hash;
+        e.size = size;
+        e.mtime = mtime;
+        entries.push_back(e);
+    }
+    std::sort(entries.begin(), entries.end(), [](const rom_entry &a, const rom_entry &b) { return a.path < b.path; });
+    return true;
+}
+
+rom_entry *rom_library::lookup(const std::string &path) {
+    auto it = std::lower_bound(entries.begin(), entries.end(), path,
+        [](const rom_entry &e, const std::string &p) { return e.path < p; });
+    return it != entries.end() && it->path == path ? &*it : nullptr;
+}
+
+// Makes sure the library knows `path` as it is on disk now. The file is only read if it is new,
+// or its size or modification time changed since it was hashed.
+const rom_entry *rom_library::add(const std::string &path) {
+    std::error_code ec;
+    fs::path p(path);
+    uint64_t size = fs::file_size(p, ec);
+    if (ec || !fs::is_regular_file(p, ec))
+        return nullptr;
+    int64_t mtime = (int64_t)fs::last_write_time(p, ec).time_since_epoch().count();
+    if (ec)
+        return nullptr;
+
+    rom_entry *known = lookup(path);
+    if (known && known->size == size && known->mtime == mtime)
+        return known;
+
+    rom_file file;
+    if (!file.open(path))
+        return nullptr;
+    uint64_t hash = fnv1a(file.data(), file.size());
+
+    rom_entry e;
+    e.path = path;
+    e.name = p.stem().string();
+    e.hash = hash;
+    e.size = size;
+    e.mtime = mtime;
+    // The profile goes with the contents: keep the one this file had, or the one a copy of it has
+    const rom_entry *same = by_hash(hash);
+    if (known && known->hash == hash)
+        e.profile = known->profile;
+    else if (same)
+        e.profile = same->profile;
+    else
+        e.profile = guess_profile(p);
+    changed = true;
+    if (known) {
+        *known = e;
+        return known;
+    }
+    auto it = std::lower_bound(entries.begin(), entries.end(), path,
+        [](const rom_entry &x, const std::string &q) { return x.path < q; });
+    return &*entries.insert(it, e);
+}
+
+int rom_library::scan() {
+    std::set<std::string> paths;
+    for (const char *dir : LIBRARY_DIRS) {
+        std::error_code ec;
+        for (fs::recursive_directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+            if (it->is_regular_file(ec) && is_rom(it->path()))
+                paths.insert(it->path().generic_string());
+        }
+    }
+    std::ifstream config(LIBRARY_CONFIG);
+    std::string line;
+    while (std::getline(config, line)) {
+        // config.txt has trailing spaces on most lines
+        while (!line.empty() && (line.back() == ' ' || line.back() == '\r'))
+            line.pop_back();
+        if (!line.empty())
+            paths.insert(line);
+    }
+    // ROMs that were picked by path from somewhere else stay as long as they exist
+    for (const rom_entry &e : entries)
+        paths.insert(e.path);
+
+    int hashed = 0;
+    std::vector<rom_entry> found;
+    for (const std::string &path : paths) {
+        const rom_entry *known = lookup(path);
+        uint64_t size = known ? known->size : 0;
+        int64_t mtime = known ? known->mtime : 0;
+        const rom_entry *e = add(path);
+        if (e == nullptr)
+            continue;
+        if (!known || e->size != size || e->mtime != mtime)
+            hashed++;
+        found.push_back(*e);
+    }
+    // Nothing new was added without add() noticing, so a shorter list means files went away
+    if (found.size() != entries.size())
+        changed = true;
+    entries.swap(found);
+    return hashed;
+}
+
+bool rom_library::save() {
+    if (!changed)
+        return true;
+    FILE *f = fopen(index_path.c_str(), "w");
+    if (f == NULL)
+        return false;
+    fprintf(f, "# ROM library, rebuilt by the emulator. Edit the profile column to change how a ROM runs.\n");
+    fprintf(f, "# hash\tprofile\tsize\tmtime\tpath\n");
+    for (const rom_entry &e : entries)
+        fprintf(f, "%016llx\t%s\t%llu\t%lld\t%s\n", (unsigned long long)e.hash, e.profile.c_str(),
+            (unsigned long long)e.size, (long long)e.mtime, e.path.c_str());
+    bool ok = !ferror(f);
+    if (fclose(f) != 0 || !ok)
+        return false;
+    changed = false;
+    return true;
+}
+
+const rom_entry *rom_library::find(const std::string &query, std::string &error) {
+    if (query.empty()) {
+        error = "no ROM given";
+        return nullptr;
+    }
+    std::error_code ec;
+    if (lookup(query) || fs::is_regular_file(query, ec)) {
+        const rom_entry *e = add(query);
+        if (e == nullptr)
+            error = "could not read " + query;
+        return e;
+    }
+
+    // An index, anything longer can only be a hash prefix and would overflow stoul
+    if (query.size() <= 9 && std::all_of(query.begin(), query.end(), [](char ch) { return std::isdigit((unsigned char)ch); })) {
+        size_t n = std::stoul(query);
+        if (n < entries.size())
+            return &entries[n];
+    }
+
+    // Hash prefixes and parts of names, an exact name beats any number of partial ones
+    std::string q = lower(query);
+    bool hex = q.size() >= 4 && q.size() <= 16 && q.find_first_not_of("0123456789abcdef") == std::string::npos;
+    std::vector<const rom_entry *> matches;
+    for (const rom_entry &e : entries) {
+        std::string name = lower(e.name);
+        if (name == q)
+            return &e;
+        if ((hex && hash_string(e.hash).compare(0, q.size(), q) == 0) || name.find(q) != std::string::npos)
+            matches.push_back(&e);
+    }
+    if (matches.size() == 1)
+        return matches[0];
+    if (matches.empty()) {
+        error = "no ROM matches \"" + query + "\"";
+        return nullptr;
+    }
+    error = "\"" + query + "\" matches " + std::to_string(matches.size()) + " ROMs:";
+    for (const rom_entry *e : matches)
+        error += "\n    " + e->path;
+    return nullptr;
+}
+
+const rom_entry *rom_library::by_hash(uint64_t hash) const {
+    for (const rom_entry &e : entries)
+        if (e.hash == hash)
+            return &e;
+    return nullptr;
+}
+
+std::string rom_library::list() const {
+    std::string out;
+    char line[64];
+    for (size_t i = 0; i < entries.size(); i++) {
+        snprintf(line, sizeof(line), "%3zu  %016llx  %-8s  ", i, (unsigned long long)entries[i].hash, entries[i].profile.c_str());
+        out += line + entries[i].path + "\n";
+    }
+    return out;
+}
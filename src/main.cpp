@@ -1,35 +1,153 @@
 #include "../headers/chip8.h"
+#include "../headers/renderer.h"
+#include "../headers/rewind.h"
+#include "../headers/pacer.h"
+#include "../headers/input.h"
+#include "../headers/lockfree.h"
+#include "../headers/audio.h"
+#include "../headers/movie.h"
+#include "../headers/library.h"
 
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <filesystem>
 
 #include <SDL2/SDL.h>
 
 const int UPSCALE = 20;
 const int WIDTH = 64*UPSCALE, HEIGHT = 32*UPSCALE;
 const int FPS = 60;
-const int FRAME_TIME = 1000/FPS;
-const int NUM_CYCLES = 700/FPS; // cycles per frame
+const int TIMER_HZ = 60;
+const int DEFAULT_IPS = 700; // instructions per second
+const int MAX_CATCHUP = 4; // timer ticks a late frame may make up before time is dropped
+const int INPUT_SLICES = 4; // batches each timer tick is run in, key changes land between them
+const int TURBO_TICKS = 16; // ticks turbo runs between looks at the command queue
+const int REWIND_SPEED = 2; // frames undone per frame of real time while rewinding
 const char* TITLE = "Niko's CHIP-8 Emulator";
-const char* CONFIG_PATH = "config.txt";
 
 enum state {START=0, PLAY, PAUSE, RESET, QUIT};
-state GAMESTATE = START;
+std::atomic<state> GAMESTATE{START};
 
-void play_loop(chip8 &chip8, SDL_Renderer *renderer);
-void pause_loop(chip8 &chip8, SDL_Renderer *renderer);
+/* Emulation speed
+Time is counted in 60 Hz timer ticks of the emulated machine. Each tick runs ips/60
+instructions (the fraction carries over to the next tick) and then decrements the delay and
+sound timers, so instructions and timers always stay in the same ratio. At normal speed, the
+number of ticks due comes from the high resolution clock, and a tick can be run part way: its
+instructions go in INPUT_SLICES batches, each given the key changes up to the moment it stands
+for. In turbo, ticks run back to back as fast as the core goes, with the game logic unchanged.
+*/
+struct speed {
+    int ips = DEFAULT_IPS;
+    bool turbo = false;
+    bool rewinding = false;
+    Uint64 last = 0;        // performance counter at the previous sync
+    double ticks_due = 0;   // timer ticks owed to the emulated machine
+    double cycles_due = 0;  // fractional instructions carried between ticks
+    double phase = 0;       // how far into the current tick the machine is, 0 to 1
+    int tick_cycles = -1;   // instructions in the current tick, -1 before it starts
+    int tick_ran = 0;       // and how many of them have run
+    double rewind_due = 0;  // frames owed to rewinding
+};
+speed SPEED;
+
+/* Threads
+The emulation thread owns the chip8, the speed and the rewind history. The SDL thread only
+collects input, renders and presents, so a slow present never holds up the core and the other
+way round. The SDL thread sends key changes and hotkey commands through a single producer,
+single consumer queue, and the emulation thread publishes finished frames through a triple
+buffer. Neither ever waits for the other. GAMESTATE is the one thing both read: the SDL thread
+sets it, the emulation thread only turns RESET back into PLAY.
+*/
+enum Command {CMD_KEY=0, CMD_IPS, CMD_TURBO, CMD_REWIND, CMD_SAVE, CMD_LOAD, CMD_PROFILE, CMD_TRACE, CMD_RECORD};
+
+struct command {
+    Command kind;
+    int value;      // ips change for CMD_IPS, on or off for CMD_REWIND
+    key_event key;  // for CMD_KEY
+#ifdef CHIP8_PROFILE
+    double seconds [PROF_SECTIONS]; // for CMD_PROFILE, frontend_profile's times when it was sent
+#endif
+};
+
+struct frame {
+    uint64_t display [PLANES][64][2];
+    bool hires;
+    uint64_t delivered;     // keypad totals when the frame was made, for the latency stats
+    double delivered_delay;
+};
+
+spsc_queue<command, 256> commands;
+triple_buffer<frame> frames;
+
+void emulate(chip8 &chip8);
+void take_commands(chip8 &chip8);
+void publish(chip8 &chip8);
+void update_sound(chip8 &chip8, bool playing);
+void show_frame(renderer &screen);
 void reset(chip8 &chip8);
 bool load_game(chip8 &chip8);
-void get_input(chip8 &chip8);
-void display_graphics(BYTE *display, SDL_Renderer *renderer);
-void display_graphics(std::string &display, SDL_Renderer *renderer);
+int list_library();
+void handle_events(renderer &screen);
+void send(const command &c);
 void sync_time(chip8 &chip8);
+void begin_tick();
+void deliver_keys(chip8 &chip8, Uint64 until);
+void run_tick(chip8 &chip8, double phase);
+void play_movie(chip8 &chip8, int ticks);
+void stop_movie(const char *why);
+bool start_movie(chip8 &chip8);
+void toggle_recording(chip8 &chip8);
+void rewind_time(chip8 &chip8);
+bool parse_args(int argc, char **argv);
+void set_ips(int ips);
+#ifdef CHIP8_PROFILE
+void print_profile(chip8 &chip8, const profiler &frontend);
+#endif
 
 std::string title_screen;
 std::string pause_screen;
+std::string state_path; // quick save slot, next to the ROM
+std::string trace_path; // F4 saves the core's trace log here, next to the ROM
+std::string game_path;
+std::string rom_query;  // the ROM asked for on the command line
+bool list_roms = false;
+bool force_variant = false;
+Variant variant = VARIANT_DEFAULT; // with --variant, instead of the library's profile
+std::string movie_path; // F3 records here, next to the ROM, unless --play gave one to play
+bool play_on_start = false;
+int trace_level = TRACE_WARN;
+
+// Emulation thread only
+rewind_buffer history; // the last five minutes of frames, for hold to rewind
+keypad pad;
+audio speaker; // opened by the SDL thread, fed by the emulation thread
+enum Film {FILM_NONE=0, FILM_RECORD, FILM_PLAY};
+Film filming = FILM_NONE;
+movie film;
+
+// SDL thread only
+pacer pace(FPS);
+#ifdef CHIP8_PROFILE
+profiler frontend_profile; // input and rendering, merged with the core's own for the reports
+#endif
+input controls;
+std::vector<command> backlog; // commands the queue had no room for yet
 
 int main (int argc, char** argv) {
+    if (!parse_args(argc, argv)) {
+        std::cerr << "Usage: main [--ips N] [--turbo] [--trace off|error|warn|info] [--variant NAME] [--play MOVIE] [--list] ROM\n";
+        return 1;
+    }
+    if (list_roms)
+        return list_library();
+
     // Not used right now. 
     title_screen =  "................................................................";
     title_screen += "................................................................";
@@ -98,199 +216,524 @@ int main (int argc, char** argv) {
     pause_screen += "................................................................";
     
     chip8 chip8;
-    load_game(chip8) ? GAMESTATE=PLAY : GAMESTATE=QUIT;
+    chip8.trace.level = trace_level;
+    if (!load_game(chip8) || (play_on_start && !start_movie(chip8)))
+        return 1;
+    GAMESTATE = PLAY;
 
     SDL_Window *window = nullptr;
-    SDL_Renderer *renderer = nullptr;
+    SDL_Renderer *sdl_renderer = nullptr;
     SDL_Init(SDL_INIT_EVERYTHING);
-    SDL_CreateWindowAndRenderer(WIDTH, HEIGHT, 0, &window, &renderer);
-    SDL_RenderSetScale(renderer, UPSCALE, UPSCALE);
+    SDL_CreateWindowAndRenderer(WIDTH, HEIGHT, 0, &window, &sdl_renderer);
     SDL_SetWindowTitle(window, TITLE);
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-    SDL_RenderClear(renderer);
+    SDL_SetRenderDrawColor(sdl_renderer, 0, 0, 0, 255);
+    SDL_RenderClear(sdl_renderer);
 
     if (window == NULL) {
         std::cerr << "Could not create window: " << SDL_GetError() << "\n";
         return 1;
     }
 
-    SDL_Event windowEvent;
+    // The 64x32 texture is stretched over the whole window when presented, no render scale needed
+    renderer screen;
+    if (!screen.init(sdl_renderer)) {
+        std::cerr << "Could not create texture: " << SDL_GetError() << "\n";
+        return 1;
+    }
+
+    if (!speaker.init())
+        std::cerr << "Could not open audio, running muted: " << SDL_GetError() << "\n";
+
+    publish(chip8);
+    std::thread emulation(emulate, std::ref(chip8));
 
     bool running = true;
     while (running) {
-        int frame_time_start = SDL_GetTicks();
+        {
+            PROFILE_SCOPE(frontend_profile, PROF_INPUT);
+            handle_events(screen);
+        }
 
         switch (GAMESTATE) {
             case START:                                     break;
-            case PLAY:      play_loop(chip8, renderer);     break;
-            case PAUSE:     pause_loop(chip8, renderer);    break;
-            case RESET:     reset(chip8);                   break;
+            case PLAY:      show_frame(screen);             break;
+            case PAUSE:     screen.draw(pause_screen);      break;
+            case RESET:                                     break;
             case QUIT:      running=false;                  break;
             default:                                        break;
         }
 
-        if (SDL_PollEvent(&windowEvent)) {
-            if (windowEvent.type == SDL_QUIT )
-                break;
+        {
+            PROFILE_SCOPE(frontend_profile, PROF_RENDER);
+            screen.present();
         }
+        const frame &shown = frames.read_buffer();
+        controls.presented(SDL_GetPerformanceCounter(), shown.delivered, shown.delivered_delay);
 
-        int frame_delta_time = SDL_GetTicks() - frame_time_start;
-        if (frame_delta_time < FRAME_TIME) 
-            SDL_Delay(FRAME_TIME-frame_delta_time);
-        
+        pace.wait();
     }
+    emulation.join();
+#ifdef CHIP8_PROFILE
+    print_profile(chip8, frontend_profile);
+#endif
     return 0;
 }
 
-void play_loop(chip8 &chip8, SDL_Renderer *renderer) {
-    get_input(chip8);
+// The emulation thread: commands, then whatever time is owed, then a nap until the next batch
+void emulate(chip8 &chip8) {
+    const auto nap = std::chrono::microseconds(1000000 / (TIMER_HZ * INPUT_SLICES));
+    state s;
+    while ((s = GAMESTATE) != QUIT) {
+        take_commands(chip8);
+        if (s == RESET) {
+            reset(chip8);
+            GAMESTATE.compare_exchange_strong(s, PLAY);
+            continue;
+        }
+        if (s != PLAY) {
+            // Time spent paused is not owed to the game
+            SPEED.last = SDL_GetPerformanceCounter();
+            update_sound(chip8, false);
+            std::this_thread::sleep_for(nap);
+            continue;
+        }
+        {
+            PROFILE_SCOPE(chip8.profile, PROF_EMULATE);
+            if (SPEED.rewinding)
+                rewind_time(chip8);
+            else
+                sync_time(chip8);
+        }
+        update_sound(chip8, !SPEED.rewinding);
+        publish(chip8);
+        if (!SPEED.turbo || SPEED.rewinding)
+            std::this_thread::sleep_for(nap);
+    }
+}
 
-    for (int i = 0; i < NUM_CYCLES; i++)
-        chip8.cycle();
+void take_commands(chip8 &chip8) {
+    command c;
+    while (commands.pop(c)) {
+        switch (c.kind) {
+            case CMD_KEY:
+            pad.push(c.key);                                   break;
+            case CMD_IPS:
+            set_ips(SPEED.ips + c.value);                      break;
+            case CMD_TURBO:
+            SPEED.turbo = !SPEED.turbo;
+            std::cout << "Turbo " << (SPEED.turbo ? "on" : "off") << "\n";
+            break;
+            case CMD_REWIND:
+            SPEED.rewinding = c.value != 0;
+            if (SPEED.rewinding)
+                stop_movie("rewinding");
+            // Time spent rewinding isn't owed to the game once backspace is let go
+            SPEED.last = SDL_GetPerformanceCounter();
+            SPEED.ticks_due = 0;
+            SPEED.rewind_due = 0;
+            break;
+            case CMD_SAVE:
+            std::cout << (chip8.save_state(state_path) ? "Saved state to " : "Could not save state to ") << state_path << "\n";
+            break;
+            case CMD_LOAD:
+            stop_movie("a state was loaded");
+            std::cout << (chip8.load_state(state_path) ? "Loaded state from " : "Could not load state from ") << state_path << "\n";
+            break;
+            case CMD_RECORD:
+            toggle_recording(chip8);                           break;
+            case CMD_TRACE:
+            std::cout << (chip8.trace.save(trace_path) ? "Saved trace to " : "Could not save trace to ") << trace_path << "\n";
+            break;
+            case CMD_PROFILE: {
+#ifdef CHIP8_PROFILE
+            // frontend_profile belongs to the SDL thread, the command brought a copy of its times
+            profiler frontend;
+            memcpy(frontend.seconds, c.seconds, sizeof(frontend.seconds));
+            print_profile(chip8, frontend);
+#endif
+            break;
+            }
+            default:                                           break;
+        }
+    }
+}
 
-    display_graphics(chip8.display, renderer);   
-    sync_time(chip8);
+// Tells the buzzer when the sound timer starts or stops, or an XO-CHIP ROM changes its pattern
+// or pitch. It stays quiet while paused or rewinding.
+void update_sound(chip8 &chip8, bool playing) {
+    static tone sent;
+    tone now;
+    now.on = playing && chip8.sound_timer > 0;
+    now.pattern_set = chip8.pattern_set != 0;
+    now.pitch = chip8.pitch;
+    memcpy(now.pattern, chip8.pattern, sizeof(now.pattern));
+    if (now != sent && speaker.set(now))
+        sent = now;
 }
 
-void pause_loop(chip8 &chip8, SDL_Renderer *renderer) {
-    get_input(chip8);
-    display_graphics(pause_screen, renderer);
+// Hands the screen to the SDL thread, unless nothing it shows has changed
+void publish(chip8 &chip8) {
+    static uint64_t was_delivered = 0;
+    if (!chip8.take_dirty_rows() && pad.delivered == was_delivered)
+        return;
+    was_delivered = pad.delivered;
+    frame &f = frames.write_buffer();
+    memcpy(f.display, chip8.display, sizeof(f.display));
+    f.hires = chip8.hires;
+    f.delivered = pad.delivered;
+    f.delivered_delay = pad.delivered_delay;
+    frames.publish();
+}
+
+// Draws the newest published frame. Rows are compared with what is on screen, since frames the
+// SDL thread never picked up carried dirty rows of their own.
+void show_frame(renderer &screen) {
+    static uint64_t on_screen [PLANES][64][2];
+    frames.update();
+    const frame &f = frames.read_buffer();
+    uint64_t dirty = 0;
+    for (int p = 0; p < PLANES; p++)
+        for (int row = 0; row < 64; row++)
+            if (f.display[p][row][0] != on_screen[p][row][0] || f.display[p][row][1] != on_screen[p][row][1])
+                dirty |= 1ull << row;
+    memcpy(on_screen, f.display, sizeof(on_screen));
+    screen.draw(f.display, f.hires, dirty);
 }
 
 void reset(chip8 &chip8) {
+    stop_movie("the game was reset");
     chip8.reset();
-    GAMESTATE = PLAY;
+    SPEED.ticks_due = 0;
+    SPEED.cycles_due = 0;
+    SPEED.phase = 0;
+    SPEED.tick_cycles = -1;
+    SPEED.tick_ran = 0;
+}
+
+bool parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--ips" && i + 1 < argc)     SPEED.ips = std::atoi(argv[++i]);
+        else if (arg == "--turbo")              SPEED.turbo = true;
+        else if (arg == "--list")               list_roms = true;
+        else if (arg == "--variant" && i + 1 < argc) {
+            if (!parse_variant(argv[++i], variant))
+                return false;
+            force_variant = true;
+        }
+        else if (arg == "--play" && i + 1 < argc) {
+            movie_path = argv[++i];
+            play_on_start = true;
+        }
+        else if (arg == "--trace" && i + 1 < argc) {
+            if (!parse_trace_level(argv[++i], trace_level))
+                return false;
+        }
+        else if (arg[0] != '-' && rom_query.empty()) rom_query = arg;
+        else                                    return false;
+    }
+    return SPEED.ips > 0;
+}
+
+void set_ips(int ips) {
+    SPEED.ips = ips < TIMER_HZ ? TIMER_HZ : ips;
+    std::cout << "Speed: " << SPEED.ips << " instructions per second\n";
+}
+
+#ifdef CHIP8_PROFILE
+// The core's counters with the SDL thread's times added, on the emulation thread or after it ended
+void print_profile(chip8 &chip8, const profiler &frontend) {
+    profiler total = chip8.profile;
+    total.merge(frontend);
+    std::cout << total.report(chip8.state().memory);
 }
+#endif
 
+// The ROM comes from the command line, a path, a number from --list, the start of its hash or
+// part of its name. Nothing is ever asked on stdin, so launchers and scripts can't hang on it.
 bool load_game(chip8 &chip8) {
-    std::vector<std::string> roms;
-    std::ifstream config_file(CONFIG_PATH);
-    if (!config_file.is_open()) {
-        std::cerr << "Error: could not open config file.\n";
+    rom_library library;
+    library.open();
+    // A path needs no scan, so scripted runs start straight away
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(rom_query, ec))
+        library.scan();
+    if (rom_query.empty()) {
+        std::cout << library.list() << "Pass one of these ROMs to play, by path, number, hash or part of its name.\n";
+        library.save();
         return false;
     }
-    std::string line;
-    while (std::getline(config_file, line)) {
-        roms.push_back(line);
+    std::string error;
+    const rom_entry *rom = library.find(rom_query, error);
+    if (rom == nullptr) {
+        std::cerr << "Error: " << error << "\n";
+        library.save();
+        return false;
+    }
+    if (!force_variant)
+        variant = rom_variant(*rom);
+    std::cout << "Loading " << rom->path << " (" << hash_string(rom->hash) << ", " << variant_name(variant) << " quirks)\n";
+    const std::string game = rom->path;
+    library.save();
+    chip8.set_variant(variant);
+    game_path = game;
+    state_path = game + ".state";
+    trace_path = game + ".trace";
+    if (!play_on_start)
+        movie_path = game + ".c8m";
+    if (!chip8.init(game)) {
+        std::vector<trace_record> log = chip8.trace.records();
+        std::cerr << "Could not load " << game;
+        if (!log.empty())
+            std::cerr << ": " << describe(log.back());
+        std::cerr << "\n";
+        return false;
     }
-    config_file.close();
-    std::cout << "Select a ROM to play on CHIP-8!\n";
-    for (int i = 0; i < roms.size(); i++) 
-        std::cout << i << " - " << roms[i] << "\n";
-    int user_selection;
-    std::cout << "Selection [enter a number]: ";
-    do {
-        std::cin >> user_selection;
-        if (user_selection >= roms.size()) {
-            std::cout << "Error: invalid selection.\n";
-        }
-    } while (user_selection >= roms.size());
-    const std::string game = roms[user_selection];
-    chip8.init(game);
     return true;
 }
 
-/* Keyboard
-    1	2	3	C
-    4	5	6	D
-    7	8	9	E
-    A	0	B	F
-*/
-void get_input(chip8 &chip8) {
-    for (int i = 0; i < 16; i++)
-        chip8.keys[i] = false;
-    
-    SDL_Event keyboardEvent;
-    if (SDL_PollEvent(&keyboardEvent)) {
-        
-        switch (keyboardEvent.type) {
-            case SDL_KEYDOWN:   
-            switch (keyboardEvent.key.keysym.sym) {
-                case SDLK_x:    chip8.keys[0x0] = true;            break;
-                case SDLK_1:    chip8.keys[0x1] = true;            break;
-                case SDLK_2:    chip8.keys[0x2] = true;            break;
-                case SDLK_3:    chip8.keys[0x3] = true;            break;
-                case SDLK_q:    chip8.keys[0x4] = true;            break;
-                case SDLK_w:    chip8.keys[0x5] = true;            break;
-                case SDLK_e:    chip8.keys[0x6] = true;            break;
-                case SDLK_a:    chip8.keys[0x7] = true;            break;
-                case SDLK_s:    chip8.keys[0x8] = true;            break;
-                case SDLK_d:    chip8.keys[0x9] = true;            break;
-                case SDLK_z:    chip8.keys[0xA] = true;            break;
-                case SDLK_c:    chip8.keys[0xB] = true;            break;
-                case SDLK_4:    chip8.keys[0xC] = true;            break;
-                case SDLK_r:    chip8.keys[0xD] = true;            break;
-                case SDLK_f:    chip8.keys[0xE] = true;            break;
-                case SDLK_v:    chip8.keys[0xF] = true;            break;
-                case SDLK_F10:    
-                GAMESTATE=(GAMESTATE==PLAY?PAUSE:PLAY);            break;
-                case SDLK_F11:
-                GAMESTATE=RESET;                                   break;
-                case SDLK_F12:
-                GAMESTATE=QUIT;                                    break;
-                default:                                           break;
-            }     
-            break; 
-
-            case SDL_KEYUP:     
-            switch (keyboardEvent.key.keysym.sym) {
-                case SDLK_x:    chip8.keys[0x0] = false;           break;
-                case SDLK_1:    chip8.keys[0x1] = false;           break;
-                case SDLK_2:    chip8.keys[0x2] = false;           break;
-                case SDLK_3:    chip8.keys[0x3] = false;           break;
-                case SDLK_q:    chip8.keys[0x4] = false;           break;
-                case SDLK_w:    chip8.keys[0x5] = false;           break;
-                case SDLK_e:    chip8.keys[0x6] = false;           break;
-                case SDLK_a:    chip8.keys[0x7] = false;           break;
-                case SDLK_s:    chip8.keys[0x8] = false;           break;
-                case SDLK_d:    chip8.keys[0x9] = false;           break;
-                case SDLK_z:    chip8.keys[0xA] = false;           break;
-                case SDLK_c:    chip8.keys[0xB] = false;           break;
-                case SDLK_4:    chip8.keys[0xC] = false;           break;
-                case SDLK_r:    chip8.keys[0xD] = false;           break;
-                case SDLK_f:    chip8.keys[0xE] = false;           break;
-                case SDLK_v:    chip8.keys[0xF] = false;           break;
-                default:                                           break;
-            }     
-            break;
+// Prints the library with the numbers load_game() takes
+int list_library() {
+    rom_library library;
+    library.open();
+    library.scan();
+    std::cout << library.list();
+    if (!library.save())
+        std::cerr << "Could not write " << LIBRARY_INDEX << "\n";
+    return 0;
+}
+
+// Queues a command for the emulation thread, keeping order if the queue is full
+void send(const command &c) {
+    backlog.push_back(c);
+}
 
-            default:
+// Everything poll() didn't take for the keypad: hotkeys and window events. Keypad changes and
+// anything the core has to do go to the emulation thread.
+void handle_events(renderer &screen) {
+    controls.poll();
+    for (const key_event &k : controls.keys)
+        send({CMD_KEY, 0, k});
+    for (const SDL_Event &event : controls.events) {
+        if (event.type == SDL_QUIT)
+            GAMESTATE = QUIT;
+        if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_EXPOSED)
+            screen.invalidate();
+        if (event.type != SDL_KEYDOWN)
+            continue;
+        switch (event.key.keysym.sym) {
+            case SDLK_MINUS:
+            send({CMD_IPS, -100});                             break;
+            case SDLK_EQUALS:
+            send({CMD_IPS, 100});                              break;
+            case SDLK_F3:
+            send({CMD_RECORD});                                break;
+            case SDLK_F4:
+            send({CMD_TRACE});                                 break;
+            case SDLK_F5:
+            send({CMD_SAVE});                                  break;
+            case SDLK_F6: {
+            command c = {CMD_PROFILE};
+#ifdef CHIP8_PROFILE
+            memcpy(c.seconds, frontend_profile.seconds, sizeof(c.seconds));
+#endif
+            send(c);
             break;
-        }        
+            }
+            case SDLK_F7:
+            std::cout << pace.report() << controls.report();
+            pace.clear_stats();
+            controls.clear_stats();
+            break;
+            case SDLK_F8:
+            send({CMD_LOAD});                                  break;
+            case SDLK_F9:
+            send({CMD_TURBO});                                 break;
+            case SDLK_F10:
+            GAMESTATE=(GAMESTATE==PLAY?PAUSE:PLAY);            break;
+            case SDLK_F11:
+            GAMESTATE=RESET;                                   break;
+            case SDLK_F12:
+            GAMESTATE=QUIT;                                    break;
+            default:                                           break;
+        }
     }
+
+    // Holding backspace runs the game backwards instead of forwards
+    static bool rewinding = false;
+    bool held = SDL_GetKeyboardState(NULL)[SDL_SCANCODE_BACKSPACE];
+    if (held != rewinding) {
+        rewinding = held;
+        send({CMD_REWIND, held});
+    }
+
+    size_t sent = 0;
+    while (sent < backlog.size() && commands.push(backlog[sent]))
+        sent++;
+    backlog.erase(backlog.begin(), backlog.begin() + sent);
 }
 
-void display_graphics(BYTE *display, SDL_Renderer *renderer) {
-    for (int x = 0; x < 64; x++) {
-        for (int y = 0; y < 32; y++)  {
+// Runs the current tick of the emulated machine up to `phase` of its ips/60 instructions.
+// Reaching 1 runs the 60 Hz timers and starts the next tick.
+void run_tick(chip8 &chip8, double phase) {
+    begin_tick();
+    int target = phase >= 1 ? SPEED.tick_cycles : (int)(phase * SPEED.tick_cycles);
+    chip8.run(target - SPEED.tick_ran);
+    SPEED.tick_ran = target;
+    SPEED.phase = phase;
+    if (phase >= 1) {
+        if (filming == FILM_RECORD)
+            film.end_frame(SPEED.tick_cycles);
+        chip8.tick_timers();
+        history.push(chip8.state(), chip8.state_size());
+        SPEED.phase = 0;
+        SPEED.tick_cycles = -1;
+        SPEED.tick_ran = 0;
+    }
+}
 
-            // If pixel is 1, paint it white.
-            // Else, paint it black.
-            int col = display[y*64+x];
-            SDL_SetRenderDrawColor(renderer, col*255, col*255, col*255, col*255);
-            SDL_RenderDrawPoint(renderer, x, y);
+// Works out how many instructions the next tick runs, if it hasn't started yet
+void begin_tick() {
+    if (SPEED.tick_cycles >= 0)
+        return;
+    if (filming == FILM_RECORD)
+        film.begin_frame(SPEED.ips);
+    SPEED.cycles_due += (double)SPEED.ips / TIMER_HZ;
+    SPEED.tick_cycles = (int)SPEED.cycles_due;
+    SPEED.cycles_due -= SPEED.tick_cycles;
+}
+
+// Hands the core the key changes up to `until`. While recording, the keypad it ends up with is
+// written down at the cycle of the tick it lands on.
+void deliver_keys(chip8 &chip8, Uint64 until) {
+    begin_tick();
+    pad.deliver(chip8, until);
+    if (filming == FILM_RECORD)
+        film.keys_at(SPEED.tick_ran, chip8.keys);
+}
+
+// Plays whole frames of the movie instead of the keyboard, then goes back to live input
+void play_movie(chip8 &chip8, int ticks) {
+    for (int i = 0; i < ticks; i++) {
+        if (!film.play_frame(chip8)) {
+            stop_movie(film.finished() ? "it is over" : "it is damaged");
+            return;
         }
+        history.push(chip8.state(), chip8.state_size());
     }
-    SDL_RenderPresent(renderer);
+    if (film.finished())
+        stop_movie("it is over");
 }
 
-void display_graphics(std::string &screen, SDL_Renderer *renderer) {
-  for (int x = 0; x < 64; x++) {
-        for (int y = 0; y < 32; y++)  {
-            int col = ((screen[y*64+x] == '#') ? 1 : 0);
-            SDL_SetRenderDrawColor(renderer, col*255, col*255, col*255, col*255);
-            SDL_RenderDrawPoint(renderer, x, y);
-        }
+void stop_movie(const char *why) {
+    if (filming == FILM_NONE)
+        return;
+    if (filming == FILM_RECORD) {
+        std::cout << "Stopped recording, " << why << ". "
+                  << (film.save(movie_path) ? "Saved movie to " : "Could not save movie to ") << movie_path << "\n";
     }
-    SDL_RenderPresent(renderer);
+    else
+        std::cout << "Stopped playing " << movie_path << " at frame " << film.frame() << ", " << why << "\n";
+    filming = FILM_NONE;
+}
+
+// Loads the movie from --play and restarts the game the way it was recorded. Runs before the
+// emulation thread starts.
+bool start_movie(chip8 &chip8) {
+    if (!film.load(movie_path)) {
+        std::cerr << "Could not load movie " << movie_path << "\n";
+        return false;
+    }
+    chip8.seed(film.seed());
+    if (!chip8.init(game_path) || !film.start(chip8)) {
+        std::cerr << "Error: " << movie_path << " was recorded with a different ROM\n";
+        return false;
+    }
+    SPEED.ips = film.start_ips();
+    std::cout << "Playing " << movie_path << ", " << film.frames() << " frames\n";
+    filming = FILM_PLAY;
+    return true;
 }
 
+// F3 starts a recording from a freshly loaded game, so it plays back from the same start, and
+// saves it on the second press
+void toggle_recording(chip8 &chip8) {
+    if (filming == FILM_RECORD) {
+        stop_movie("F3 was pressed");
+        return;
+    }
+    stop_movie("recording instead");
+    if (!chip8.init(game_path)) {
+        std::cout << "Could not reload " << game_path << " to record\n";
+        return;
+    }
+    SPEED.cycles_due = 0;
+    SPEED.phase = 0;
+    SPEED.tick_cycles = -1;
+    SPEED.tick_ran = 0;
+    film.record(chip8, SPEED.ips);
+    filming = FILM_RECORD;
+    std::cout << "Recording to " << movie_path << ", F3 again to stop\n";
+}
+
+// Steps back through the recorded frames at REWIND_SPEED times real time. Only the last one
+// is loaded into the machine.
+void rewind_time(chip8 &chip8) {
+    Uint64 now = SDL_GetPerformanceCounter();
+    SPEED.rewind_due += (now - SPEED.last) / (double)SDL_GetPerformanceFrequency() * TIMER_HZ * REWIND_SPEED;
+    SPEED.last = now;
+    if (SPEED.rewind_due > MAX_CATCHUP * REWIND_SPEED)
+        SPEED.rewind_due = MAX_CATCHUP * REWIND_SPEED;
+    static machine_state state; // 64 KB of memory is too much for the thread's stack
+    bool moved = false;
+    for (; SPEED.rewind_due >= 1; SPEED.rewind_due -= 1)
+        moved = history.step_back(state) || moved;
+    if (moved)
+        chip8.load_state(state);
+}
+
+// Runs the timer ticks that are due since the last call by wall clock, or a batch of them in turbo
 void sync_time(chip8 &chip8) {
-    if (chip8.delay_timer > 0)
-        --chip8.delay_timer;
+    Uint64 now = SDL_GetPerformanceCounter();
+    double freq = (double)SDL_GetPerformanceFrequency();
+    if (SPEED.last == 0)
+        SPEED.last = now;
 
-    if (chip8.sound_timer > 0) {
-        std::cout << "Beep!\n";
-        --chip8.sound_timer;
+    if (SPEED.turbo) {
+        if (filming == FILM_PLAY) {
+            play_movie(chip8, TURBO_TICKS);
+            SPEED.last = SDL_GetPerformanceCounter();
+            SPEED.ticks_due = 0;
+            return;
+        }
+        deliver_keys(chip8, now);
+        for (int i = 0; i < TURBO_TICKS; i++)
+            run_tick(chip8, 1);
+        SPEED.last = SDL_GetPerformanceCounter();
+        SPEED.ticks_due = 0;
+        return;
+    }
+
+    SPEED.ticks_due += (now - SPEED.last) / freq * TIMER_HZ;
+    SPEED.last = now;
+    // After a stall (window drag, breakpoint) drop the backlog instead of running it all at once
+    if (SPEED.ticks_due > MAX_CATCHUP)
+        SPEED.ticks_due = MAX_CATCHUP;
+    // A movie is played a whole tick at a time, with the key changes where they were recorded
+    if (filming == FILM_PLAY) {
+        int ticks = (int)SPEED.ticks_due;
+        SPEED.ticks_due -= ticks;
+        play_movie(chip8, ticks);
+        return;
+    }
+    // The owed time ends now, so the slice that still has `ticks_due` after it stands for
+    // that long ago. Each slice gets the key changes up to its end before it runs.
+    while (SPEED.ticks_due > 0) {
+        double boundary = std::floor(SPEED.phase * INPUT_SLICES + 1) / INPUT_SLICES;
+        double step = std::min(boundary - SPEED.phase, SPEED.ticks_due);
+        double phase = step < boundary - SPEED.phase ? SPEED.phase + step : boundary;
+        SPEED.ticks_due -= step;
+        deliver_keys(chip8, now - (Uint64)(SPEED.ticks_due / TIMER_HZ * freq));
+        run_tick(chip8, phase);
     }
 }
@@ -0,0 +1,223 @@
+#include "../headers/movie.h"
+#include "../headers/library.h"
+
+#include <cstdio>
+#include <cstring>
+
+// The first 4 KB, and as much after it as the ROM filled, so movies of ROMs that fit in 4 KB
+// keep the hash they had before memory grew
+uint64_t movie::image_hash(const chip8 &c) {
+    const BYTE *memory = c.state().memory;
+    size_t end = MEMORY_SIZE;
+    while (end > CODE_SIZE && memory[end - 1] == 0)
+        end--;
+    return fnv1a(memory, end);
+}
+
+// Same fractional carry as the frontend, so both cut frames at the same instructions
+int movie::scheduled_cycles() {
+    cycles_due += (double)ips / 60;
+    int cycles = (int)cycles_due;
+    cycles_due -= cycles;
+    return cycles;
+}
+
+// 7 bits at a time, low bits first, top bit set on every byte but the last
+void movie::put(uint32_t value) {
+    while (value >= 0x80) {
+        ops.push_back((BYTE)(value | 0x80));
+        value >>= 7;
+    }
+    ops.push_back((BYTE)value);
+}
+
+bool movie::get(uint32_t &value) {
+    value = 0;
+    for (int shift = 0; shift < 35 && cursor < ops.size(); shift += 7) {
+        BYTE b = ops[cursor++];
+        value |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+void movie::flush_quiet() {
+    if (quiet == 0)
+        return;
+    put(OP_QUIET);
+    put(quiet);
+    quiet = 0;
+}
+
+void movie::record(const chip8 &c, int start_ips) {
+    memcpy(header.magic, MOVIE_MAGIC, sizeof(header.magic));
+    header.version = MOVIE_VERSION;
+    header.seed = c.get_seed();
+    header.image_hash = image_hash(c);
+    header.ips = start_ips;
+    header.frames = 0;
+    header.size = 0;
+    header.variant = c.get_variant();
+    ops.clear();
+    ips = start_ips;
+    cycles_due = 0;
+    quiet = 0;
+    frame_changes.clear();
+    recorded_keys = 0;
+}
+
+void movie::begin_frame(int frame_ips) {
+    if (frame_ips != ips) {
+        flush_quiet();
+        put(OP_IPS);
+        put(frame_ips);
+        ips = frame_ips;
+    }
+    expected = scheduled_cycles();
+}
+
+void movie::keys_at(int offset, const BYTE *pad) {
+    WORD mask = 0;
+    for (int i = 0; i < 16; i++)
+        if (pad[i])
+            mask |= 1 << i;
+    if (mask == recorded_keys)
+        return;
+    frame_changes.push_back((uint32_t)offset << 16 | mask);
+    recorded_keys = mask;
+}
+
+void movie::end_frame(int cycles) {
+    if (cycles != expected) {
+        flush_quiet();
+        put(OP_CYCLES);
+        put(cycles);
+    }
+    if (frame_changes.empty())
+        quiet++;
+    else {
+        flush_quiet();
+        put(OP_KEYS);
+        put((uint32_t)frame_changes.size());
+        uint32_t at = 0;
+        for (uint32_t change : frame_changes) {
+            put((change >> 16) - at);
+            put(change & 0xFFFF);
+            at = change >> 16;
+        }
+        frame_changes.clear();
+    }
+    header.frames++;
+}
+
+bool movie::save(const std::string &path) {
+    flush_quiet();
+    header.size = (uint32_t)ops.size();
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f == NULL)
+        return false;
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+        && (ops.empty() || fwrite(ops.data(), 1, ops.size(), f) == ops.size());
+    return fclose(f) == 0 && ok;
+}
+
+bool movie::load(const std::string &path) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL)
+        return false;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1
+        && memcmp(header.magic, MOVIE_MAGIC, sizeof(header.magic)) == 0
+        && (header.version == 1 || header.version == MOVIE_VERSION);
+    if (ok && header.version == 1)
+        header.variant = VARIANT_DEFAULT;
+    if (ok) {
+        ops.resize(header.size);
+        ok = header.size == 0 || fread(ops.data(), 1, ops.size(), f) == ops.size();
+    }
+    fclose(f);
+    return ok;
+}
+
+// Seeds the machine like the recording was and checks it holds the same ROM. The machine must
+// be fresh from load().
+bool movie::start(chip8 &c) {
+    c.seed(header.seed);
+    if (image_hash(c) != header.image_hash || header.variant >= VARIANTS)
+        return false;
+    c.set_variant((Variant)header.variant);
+    ips = header.ips;
+    cycles_due = 0;
+    cursor = 0;
+    played = 0;
+    quiet_left = 0;
+    keys = 0;
+    frame_changes.clear();
+    return true;
+}
+
+// Runs one whole frame, with its key changes at their cycles and the timer tick at the end.
+// False once the movie is over, or if its ops are damaged.
+bool movie::play_frame(chip8 &c) {
+    if (finished())
+        return false;
+    int cycles_override = -1;
+    if (quiet_left == 0) {
+        frame_changes.clear();
+        for (;;) {
+            uint32_t op, value, count;
+            if (!get(op)) {
+                played = header.frames;
+                return false;
+            }
+            if (op == OP_IPS && get(value))
+                ips = value;
+            else if (op == OP_CYCLES && get(value))
+                cycles_override = value;
+            else if (op == OP_QUIET && get(count)) {
+                quiet_left = count;
+                break;
+            }
+            else if (op == OP_KEYS && get(count)) {
+                uint32_t at = 0, delta, mask;
+                for (uint32_t i = 0; i < count && get(delta) && get(mask); i++) {
+                    at += delta;
+                    frame_changes.push_back(at << 16 | (mask & 0xFFFF));
+                }
+                break;
+            }
+            else {
+                played = header.frames;
+                return false;
+            }
+        }
+    }
+
+    int cycles = scheduled_cycles();
+    if (cycles_override >= 0)
+        cycles = cycles_override;
+    auto set_keys = [&](WORD mask) {
+        keys = mask;
+        for (int i = 0; i < 16; i++)
+            c.keys[i] = (mask >> i) & 1;
+    };
+    set_keys(keys);
+    if (quiet_left > 0) {
+        quiet_left--;
+        c.run(cycles);
+    }
+    else {
+        int at = 0;
+        for (uint32_t change : frame_changes) {
+            int offset = change >> 16;
+            c.run(offset - at);
+            at = offset;
+            set_keys(change & 0xFFFF);
+        }
+        c.run(cycles - at);
+        frame_changes.clear();
+    }
+    c.tick_timers();
+    played++;
+    return true;
+}
@@ -0,0 +1,100 @@
+#include "../headers/pacer.h"
+
+#include <cmath>
+#include <cstdio>
+
+const double MIN_MARGIN = 0.00025; // seconds of spin no matter how punctual the sleeps are
+const double MAX_MARGIN = 0.004;
+
+pacer::pacer(double hz) {
+    freq = (double)SDL_GetPerformanceFrequency();
+    period = freq / hz;
+    margin = 0.002;
+}
+
+// Next wait() counts from now, for after anything that held the loop up on purpose
+void pacer::restart() {
+    start = 0;
+}
+
+// Blocks until the next frame is due
+void pacer::wait() {
+    Uint64 now = SDL_GetPerformanceCounter();
+    if (start == 0) {
+        start = last_wake = now;
+        frame = 0;
+    }
+    frame++;
+    Uint64 deadline = start + (Uint64)(frame * period);
+    if (now > deadline + (Uint64)period) {
+        missed++;
+        start = last_wake = now;
+        frame = 0;
+        return;
+    }
+    sleep_until(deadline);
+    // Spin out the last part, the sleeps above can't be trusted to the sub-millisecond
+    while ((now = SDL_GetPerformanceCounter()) < deadline)
+        ;
+    record(now, deadline);
+}
+
+void pacer::sleep_until(Uint64 deadline) {
+    for (;;) {
+        Uint64 now = SDL_GetPerformanceCounter();
+        if (now >= deadline)
+            return;
+        double left = (deadline - now) / freq - margin;
+        int ms = (int)(left * 1000);
+        if (ms < 1)
+            return;
+        // With NULL the event stays queued for the main loop. Once one is waiting this returns
+        // straight away, so sleep without it for the rest of the frame.
+        if (SDL_WaitEventTimeout(NULL, ms) == 1) {
+            now = SDL_GetPerformanceCounter();
+            left = now < deadline ? (deadline - now) / freq - margin : 0;
+            ms = (int)(left * 1000);
+            if (ms < 1)
+                return;
+            SDL_Delay(ms);
+        }
+        // How late the OS woke us up decides how early to stop sleeping next time. Jump up
+        // right away on a late wake up, creep back down while they are on time.
+        double overslept = (SDL_GetPerformanceCounter() - now) / freq - ms / 1000.0;
+        if (overslept * 1.25 > margin)
+            margin = std::fmin(overslept * 1.25, MAX_MARGIN);
+        else
+            margin = std::fmax(margin * 0.99, MIN_MARGIN);
+    }
+}
+
+void pacer::record(Uint64 now, Uint64 deadline) {
+    double between = (now - last_wake) / freq;
+    double late = (now - deadline) / freq;
+    last_wake = now;
+    frames++;
+    period_sum += between;
+    period_squares += between * between;
+    late_sum += late;
+    if (late > late_worst)
+        late_worst = late;
+}
+
+std::string pacer::report() const {
+    if (frames == 0)
+        return "Pacing: no frames yet\n";
+    double mean = period_sum / frames;
+    double jitter = std::sqrt(std::fmax(period_squares / frames - mean * mean, 0.0));
+    char line[256];
+    snprintf(line, sizeof(line),
+        "Pacing: %llu frames at %.3f Hz, period %.3f ms +- %.3f ms, late %.3f ms on average and %.3f ms at worst, "
+        "%llu restarts, spin margin %.2f ms\n",
+        (unsigned long long)frames, 1 / mean, mean * 1e3, jitter * 1e3, late_sum / frames * 1e3, late_worst * 1e3,
+        (unsigned long long)missed, margin * 1e3);
+    return line;
+}
+
+void pacer::clear_stats() {
+    frames = missed = 0;
+    period_sum = period_squares = late_sum = late_worst = 0;
+}
@@ -0,0 +1,165 @@
+#include "../headers/profiler.h"
+#include "../headers/chip8.h"
+#include "../headers/disasm.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cstdarg>
+#include <algorithm>
+#include <vector>
+
+static_assert(OPC_COUNT <= profiler::KINDS, "profiler::KINDS is too small for the Opcode enum");
+
+const int HOT_SPOTS = 20;   // addresses listed in the report
+const int HOT_LOOPS = 3;    // loops listed with the instructions in them
+const int LOOP_LINES = 32;  // longest listing per loop
+
+// Same order as the Opcode enum
+static const char *const opcode_names[OPC_COUNT] = {
+    "0NNN", "00E0", "00EE", "1NNN", "2NNN", "3XNN", "4XNN", "5XY0", "6XNN", "7XNN",
+    "8XY0", "8XY1", "8XY2", "8XY3", "8XY4", "8XY5", "8XY6", "8XY7", "8XYE", "9XY0",
+    "ANNN", "BNNN", "CXNN", "DXYN", "EX9E", "EXA1", "FX07", "FX0A", "FX15", "FX18",
+    "FX1E", "FX29", "FX33", "FX55", "FX65", "00CN", "00FB", "00FC", "00FD", "00FE",
+    "00FF", "DXY0", "FX30", "FX75", "FX85", "00DN", "5XY2", "5XY3", "F000", "FN01",
+    "F002", "FX3A", "invalid"
+};
+
+// Rough buckets for telling draw bound ROMs from ALU bound ones
+enum Family {FAM_DRAW=0, FAM_ALU, FAM_MEMORY, FAM_FLOW, FAM_TIMERS_INPUT, FAM_OTHER, FAM_COUNT};
+static const char *const family_names[FAM_COUNT] = {"draw", "alu", "memory", "flow", "timers/input", "other"};
+
+static Family family(int kind) {
+    switch (kind) {
+        case OPC_00E0: case OPC_DXYN: case OPC_DXY0: case OPC_00CN: case OPC_00FB: case OPC_00FC:
+        case OPC_00FE: case OPC_00FF: case OPC_00DN: case OPC_FN01:
+            return FAM_DRAW;
+        case OPC_6XNN: case OPC_7XNN: case OPC_8XY0: case OPC_8XY1: case OPC_8XY2: case OPC_8XY3:
+        case OPC_8XY4: case OPC_8XY5: case OPC_8XY6: case OPC_8XY7: case OPC_8XYE: case OPC_ANNN:
+        case OPC_CXNN: case OPC_FX1E: case OPC_FX29: case OPC_FX30: case OPC_FX33:
+            return FAM_ALU;
+        case OPC_FX55: case OPC_FX65: case OPC_FX75: case OPC_FX85: case OPC_5XY2: case OPC_5XY3:
+        case OPC_F000: case OPC_F002:
+            return FAM_MEMORY;
+        case OPC_00EE: case OPC_1NNN: case OPC_2NNN: case OPC_3XNN: case OPC_4XNN: case OPC_5XY0:
+        case OPC_9XY0: case OPC_BNNN: case OPC_EX9E: case OPC_EXA1:
+            return FAM_FLOW;
+        case OPC_FX07: case OPC_FX0A: case OPC_FX15: case OPC_FX18: case OPC_FX3A:
+            return FAM_TIMERS_INPUT;
+        default:
+            return FAM_OTHER;
+    }
+}
+
+void profiler::clear() {
+    memset(opcodes, 0, sizeof(opcodes));
+    memset(pcs, 0, sizeof(pcs));
+    memset(seconds, 0, sizeof(seconds));
+}
+
+void profiler::merge(const profiler &other) {
+    for (int k = 0; k < KINDS; k++)
+        opcodes[k] += other.opcodes[k];
+    for (int a = 0; a < 4096; a++)
+        pcs[a] += other.pcs[a];
+    for (int s = 0; s < PROF_SECTIONS; s++)
+        seconds[s] += other.seconds[s];
+}
+
+static void append(std::string &out, const char *format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    out += line;
+}
+
+static WORD opcode_at(const BYTE *memory, int addr) {
+    return memory[addr & 0xFFF] << 8 | memory[(addr + 1) & 0xFFF];
+}
+
+std::string profiler::report(const BYTE *memory) const {
+    std::string out;
+    uint64_t total = 0;
+    for (int k = 0; k < OPC_COUNT; k++)
+        total += opcodes[k];
+    if (total == 0)
+        return "Profile: nothing executed yet\n";
+    auto percent = [&](uint64_t n) { return 100.0 * n / total; };
+
+    append(out, "Profile: %llu instructions\n", (unsigned long long)total);
+    append(out, "Time: emulate %.1f ms (decode %.1f ms), input %.1f ms, render %.1f ms\n",
+        seconds[PROF_EMULATE] * 1e3, seconds[PROF_DECODE] * 1e3, seconds[PROF_INPUT] * 1e3, seconds[PROF_RENDER] * 1e3);
+
+    // Families first, that is the one line answer to "what is this ROM busy with"
+    uint64_t families[FAM_COUNT] = {};
+    for (int k = 0; k < OPC_COUNT; k++)
+        families[family(k)] += opcodes[k];
+    int top = 0;
+    out += "Families:";
+    for (int f = 0; f < FAM_COUNT; f++) {
+        append(out, " %s %.1f%%", family_names[f], percent(families[f]));
+        if (families[f] > families[top])
+            top = f;
+    }
+    append(out, " (mostly %s)\n", family_names[top]);
+
+    std::vector<int> kinds;
+    for (int k = 0; k < OPC_COUNT; k++)
+        if (opcodes[k])
+            kinds.push_back(k);
+    std::sort(kinds.begin(), kinds.end(), [&](int a, int b) { return opcodes[a] > opcodes[b]; });
+    out += "Opcodes:\n";
+    for (int k : kinds)
+        append(out, "  %-8s %12llu  %5.1f%%\n", opcode_names[k], (unsigned long long)opcodes[k], percent(opcodes[k]));
+
+    std::vector<int> addrs;
+    for (int a = 0; a < 4096; a++)
+        if (pcs[a])
+            addrs.push_back(a);
+    std::sort(addrs.begin(), addrs.end(), [&](int a, int b) { return pcs[a] > pcs[b]; });
+    if (addrs.size() > HOT_SPOTS)
+        addrs.resize(HOT_SPOTS);
+    out += "Hot spots:\n";
+    for (int a : addrs)
+        append(out, "  0x%03X %12llu  %5.1f%%  %s\n", a, (unsigned long long)pcs[a], percent(pcs[a]),
+            disassemble(opcode_at(memory, a)).c_str());
+
+    // A loop is a JP that was executed and goes back to or before itself. Its weight is
+    // everything executed between the target and the jump. When several jumps go back to the
+    // same place, the furthest one stands for the whole loop.
+    struct loop { int start, end; uint64_t weight; };
+    std::vector<loop> loops;
+    int loop_end [4096];
+    memset(loop_end, -1, sizeof(loop_end));
+    for (int a = 0; a < 4095; a++) {
+        WORD opcode = opcode_at(memory, a);
+        if (pcs[a] && (opcode & 0xF000) == 0x1000 && (opcode & 0x0FFF) <= a)
+            loop_end[opcode & 0x0FFF] = a;
+    }
+    for (int start = 0; start < 4096; start++) {
+        if (loop_end[start] < 0)
+            continue;
+        loop l = {start, loop_end[start], 0};
+        for (int i = l.start; i <= l.end; i++)
+            l.weight += pcs[i];
+        loops.push_back(l);
+    }
+    std::sort(loops.begin(), loops.end(), [](const loop &a, const loop &b) { return a.weight > b.weight; });
+    if (loops.size() > HOT_LOOPS)
+        loops.resize(HOT_LOOPS);
+    out += "Hottest loops:\n";
+    for (const loop &l : loops) {
+        append(out, "  0x%03X-0x%03X  %5.1f%% of instructions\n", l.start, l.end, percent(l.weight));
+        // Instructions are 2 bytes, but a loop can start on an odd address, keep its alignment
+        int lines = 0;
+        for (int i = l.start; i <= l.end; i += 2, lines++) {
+            if (lines == LOOP_LINES) {
+                append(out, "    ... %d more\n", (l.end - i) / 2 + 1);
+                break;
+            }
+            append(out, "    0x%03X %12llu  %s\n", i, (unsigned long long)pcs[i], disassemble(opcode_at(memory, i)).c_str());
+        }
+    }
+    return out;
+}
@@ -0,0 +1,18 @@
+#include "../headers/quirks.h"
+
+// Same order as the Variant enum, these are also the names the ROM library uses
+static const char *const variant_names[VARIANTS] = {"default", "vip", "chip48", "schip", "xochip"};
+
+const char *variant_name(Variant v) {
+    return v >= 0 && v < VARIANTS ? variant_names[v] : "?";
+}
+
+bool parse_variant(const std::string &name, Variant &v) {
+    for (int i = 0; i < VARIANTS; i++) {
+        if (name == variant_names[i]) {
+            v = (Variant)i;
+            return true;
+        }
+    }
+    return false;
+}
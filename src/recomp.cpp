@@ -0,0 +1,349 @@
+#include "../headers/chip8.h"
+#include "../headers/aot.h"
+#include "../headers/cfg.h"
+#include "../headers/disasm.h"
+#include "../headers/library.h"
+#include "../headers/tools.h"
+
+#include <iostream>
+#include <cstdio>
+#include <cstdarg>
+#include <filesystem>
+#include <memory>
+
+/* Ahead-of-time recompiler
+Turns ROMs into C++ for the AOT engine (see aot.h), one file per ROM and profile, named
+after the ROM's hash. `make aot` translates every ROM in the library into aot/, and the
+headless runner, the benchmarks and conform build with whatever is there; pick it with -e aot.
+
+Usage: recomp [options] [rom ...]
+    -q, --variant NAME  translate for this profile (default: the one the ROM library has)
+    -d, --dir DIR       where the files go (default aot)
+    --cfg               print each ROM's blocks, where they go and what was left as data,
+                        and translate nothing
+ROMs can be paths, numbers, hashes or names from the ROM library, with none given every
+ROM in it is used.
+*/
+
+// The Opcode enum as written, for the handler calls in generated code
+static const char *const kind_names[OPC_COUNT] = {
+    "OPC_0NNN", "OPC_00E0", "OPC_00EE", "OPC_1NNN", "OPC_2NNN", "OPC_3XNN", "OPC_4XNN", "OPC_5XY0", "OPC_6XNN", "OPC_7XNN",
+    "OPC_8XY0", "OPC_8XY1", "OPC_8XY2", "OPC_8XY3", "OPC_8XY4", "OPC_8XY5", "OPC_8XY6", "OPC_8XY7", "OPC_8XYE", "OPC_9XY0",
+    "OPC_ANNN", "OPC_BNNN", "OPC_CXNN", "OPC_DXYN", "OPC_EX9E", "OPC_EXA1", "OPC_FX07", "OPC_FX0A", "OPC_FX15", "OPC_FX18",
+    "OPC_FX1E", "OPC_FX29", "OPC_FX33", "OPC_FX55", "OPC_FX65", "OPC_00CN", "OPC_00FB", "OPC_00FC", "OPC_00FD", "OPC_00FE",
+    "OPC_00FF", "OPC_DXY0", "OPC_FX30", "OPC_FX75", "OPC_FX85", "OPC_00DN", "OPC_5XY2", "OPC_5XY3", "OPC_F000", "OPC_FN01",
+    "OPC_F002", "OPC_FX3A", "OPC_INVALID"
+};
+
+struct options {
+    bool force_variant = false;
+    Variant variant = VARIANT_DEFAULT;
+    std::string dir = "aot";
+    bool cfg = false;
+    std::vector<std::string> roms;
+    std::vector<Variant> variants;
+};
+
+void usage() {
+    std::cerr << "Usage: recomp [-q variant] [-d dir] [--cfg] [rom ...]\n";
+}
+
+bool parse_args(int argc, char **argv, options &opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if ((arg == "-q" || arg == "--variant") && has_value) {
+            if (!parse_variant(argv[++i], opt.variant)) {
+                std::cerr << "Error: unknown variant " << argv[i] << "\n";
+                return false;
+            }
+            opt.force_variant = true;
+        }
+        else if ((arg == "-d" || arg == "--dir") && has_value)      opt.dir = argv[++i];
+        else if (arg == "--cfg")                                    opt.cfg = true;
+        else if (arg == "-h" || arg == "--help")                    return false;
+        else if (!arg.empty() && arg[0] == '-') {
+            std::cerr << "Error: unknown option " << arg << "\n";
+            return false;
+        }
+        else opt.roms.push_back(arg);
+    }
+    return true;
+}
+
+// printf onto the end of a string
+static void append(std::string &out, const char *format, ...) {
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    out += text;
+}
+
+static std::string quoted(const std::string &s) {
+    std::string out = "\"";
+    for (char ch : s) {
+        if (ch == '"' || ch == '\\')
+            out += '\\';
+        out += ch;
+    }
+    return out + "\"";
+}
+
+// Writes one ROM's blocks as labels in a single function. The statements follow the opcXXXX
+// handlers line for line, with the variant's quirks decided here rather than in the code.
+class translator {
+    private:
+    const chip8 &c;
+    const rom_cfg &cfg;
+    quirk_flags q;
+    std::string body;
+    std::string ops;        // operands of the handler calls
+    int handler_calls = 0;
+
+    // To the block at t, or back to aot::run() with pc on t if no block starts there
+    std::string go(int t) {
+        char text[64];
+        if (t < (int)CODE_SIZE && cfg.find((WORD)t) >= 0)
+            snprintf(text, sizeof(text), "goto L%03X;", t);
+        else
+            snprintf(text, sizeof(text), "c.pc = 0x%03X; return cycles;", t & 0xFFFF);
+        return text;
+    }
+
+    // Instructions whose code above already went somewhere
+    static bool leaves(Opcode kind) {
+        switch (kind) {
+            case OPC_1NNN: case OPC_2NNN: case OPC_00EE: case OPC_BNNN: case OPC_INVALID: case OPC_FX0A: case OPC_00FD:
+            case OPC_3XNN: case OPC_4XNN: case OPC_5XY0: case OPC_9XY0: case OPC_EX9E: case OPC_EXA1:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // pc past the instruction, as the interpreter has it, then the handler it would have run
+    void handler(WORD a, WORD next, Opcode kind, WORD op) {
+        append(body, "    c.pc = 0x%03X; h[%s](c, ops[%d]);\n", next, kind_names[kind], handler_calls);
+        append(ops, "        {nullptr, 0x%03X, %d, %d, %d, 0x%02X, %s}, // 0x%03X\n",
+            op & 0xFFF, (op >> 8) & 0xF, (op >> 4) & 0xF, op & 0xF, op & 0xFF, kind_names[kind], a);
+        handler_calls++;
+    }
+
+    void instruction(WORD a, bool last) {
+        Opcode kind = c.kind_at(a);
+        WORD op = c.opcode_at(a);
+        int x = (op >> 8) & 0xF, y = (op >> 4) & 0xF, nn = op & 0xFF, nnn = op & 0xFFF;
+        int shifted = q.shift_vy ? y : x;
+        WORD next = a + instruction_size(kind);
+        std::string text = kind == OPC_F000 ? "LD I, long" : disassemble(op);
+        append(body, "    // 0x%03X  %s\n", a, text.c_str());
+
+        switch (kind) {
+            case OPC_0NNN:                                                                              break;
+            case OPC_6XNN:  append(body, "    V[0x%X] = 0x%02X;\n", x, nn);                             break;
+            case OPC_7XNN:  append(body, "    V[0x%X] += 0x%02X;\n", x, nn);                            break;
+            case OPC_8XY0:  append(body, "    V[0x%X] = V[0x%X];\n", x, y);                             break;
+            case OPC_8XY1:
+            case OPC_8XY2:
+            case OPC_8XY3:
+                append(body, "    V[0x%X] %s= V[0x%X];\n", x, kind == OPC_8XY1 ? "|" : kind == OPC_8XY2 ? "&" : "^", y);
+                if (q.vf_reset)
+                    append(body, "    V[0xF] = 0;\n");
+                break;
+            case OPC_8XY4:
+                append(body, "    V[0xF] = 0;\n    if (V[0x%X] > 0xFF - V[0x%X]) V[0xF] = 1;\n    V[0x%X] += V[0x%X];\n", y, x, x, y);
+                break;
+            case OPC_8XY5:
+                append(body, "    V[0xF] = 1;\n    if (V[0x%X] < V[0x%X]) V[0xF] = 0;\n    V[0x%X] -= V[0x%X];\n", x, y, x, y);
+                break;
+            case OPC_8XY6:
+                append(body, "    { BYTE from = V[0x%X]; V[0x%X] = from >> 1; V[0xF] = from & 1; }\n", shifted, x);
+                break;
+            case OPC_8XY7:
+                append(body, "    V[0xF] = 1;\n    if (V[0x%X] < V[0x%X]) V[0xF] = 0;\n    V[0x%X] = V[0x%X] - V[0x%X];\n", y, x, x, y, x);
+                break;
+            case OPC_8XYE:
+                append(body, "    { BYTE from = V[0x%X]; V[0x%X] = from << 1; V[0xF] = from >> 7; }\n", shifted, x);
+                break;
+            case OPC_ANNN:  append(body, "    c.I = 0x%03X;\n", nnn);                                   break;
+            case OPC_CXNN:  append(body, "    V[0x%X] = c.random_byte() & 0x%02X;\n", x, nn);           break;
+            case OPC_FX07:  append(body, "    V[0x%X] = c.delay_timer;\n", x);                          break;
+            case OPC_FX15:  append(body, "    c.delay_timer = V[0x%X];\n", x);                          break;
+            case OPC_FX18:  append(body, "    c.sound_timer = V[0x%X];\n", x);                          break;
+            case OPC_FX1E:  append(body, "    c.I += V[0x%X];\n", x);                                   break;
+            case OPC_FX29:  append(body, "    c.I = V[0x%X] * 5;\n", x);                                break;
+            case OPC_FX30:  append(body, "    c.I = chip8::BIG_FONT + (V[0x%X] & 0xF) * 10;\n", x);     break;
+            case OPC_FN01:  append(body, "    c.planes = 0x%X;\n", x);                                  break;
+            case OPC_F000:  append(body, "    c.I = 0x%04X;\n", c.opcode_at(a + 2));                    break;
+
+            case OPC_1NNN:
+                // Backward jumps may be idle loops, idle_skip() wants pc on the target
+                if (nnn <= a)
+                    append(body, "    c.pc = 0x%03X;\n    cycles = c.idle_skip(0x%03X, cycles);\n", nnn, a);
+                append(body, "    %s\n", go(nnn).c_str());
+                break;
+            case OPC_2NNN:
+                handler(a, next, kind, op);
+                append(body, "    %s\n", go(nnn).c_str());
+                break;
+            case OPC_3XNN: case OPC_4XNN: case OPC_5XY0: case OPC_9XY0: case OPC_EX9E: case OPC_EXA1: {
+                int over = q.xochip && c.opcode_at(next) == 0xF000 ? 4 : 2;
+                // VX against itself always skips on 5XY0 and never on 9XY0
+                if ((kind == OPC_5XY0 || kind == OPC_9XY0) && x == y) {
+                    append(body, "    %s\n", go(kind == OPC_5XY0 ? next + over : next).c_str());
+                    break;
+                }
+                char cond[64];
+                switch (kind) {
+                    case OPC_3XNN:  snprintf(cond, sizeof(cond), "V[0x%X] == 0x%02X", x, nn);         break;
+                    case OPC_4XNN:  snprintf(cond, sizeof(cond), "V[0x%X] != 0x%02X", x, nn);         break;
+                    case OPC_5XY0:  snprintf(cond, sizeof(cond), "V[0x%X] == V[0x%X]", x, y);         break;
+                    case OPC_9XY0:  snprintf(cond, sizeof(cond), "V[0x%X] != V[0x%X]", x, y);         break;
+                    case OPC_EX9E:  snprintf(cond, sizeof(cond), "c.keys[V[0x%X] & 0xF] != 0", x);    break;
+                    default:        snprintf(cond, sizeof(cond), "c.keys[V[0x%X] & 0xF] == 0", x);    break;
+                }
+                append(body, "    if (%s) { %s }\n    %s\n", cond, go(next + over).c_str(), go(next).c_str());
+                break;
+            }
+            case OPC_FX0A:
+                // Starts its own block, so waiting is going back to the start of it
+                handler(a, next, kind, op);
+                append(body, "    if (c.pc == 0x%03X) { cycles = c.idle_wait(cycles); %s }\n    %s\n", a, go(a).c_str(), go(next).c_str());
+                break;
+            case OPC_00FD:
+                append(body, "    cycles = c.idle_wait(cycles);\n    %s\n", go(a).c_str());
+                break;
+            case OPC_00EE: case OPC_BNNN: case OPC_INVALID:
+                handler(a, next, kind, op);
+                append(body, "    goto dispatch;\n");
+                break;
+
+            default:
+                handler(a, next, kind, op);
+                break;
+        }
+        // Blocks that end on anything else run on into the next instruction
+        if (last && !leaves(kind))
+            append(body, "    %s\n", go(next).c_str());
+    }
+
+    public:
+    translator(const chip8 &machine, const rom_cfg &graph) : c(machine), cfg(graph), q(machine.get_quirks()) {}
+
+    std::string translate(const std::string &path, uint64_t hash) {
+        std::string tag = "rom_" + hash_string(hash);
+        Variant v = c.get_variant();
+        body.clear();
+        ops.clear();
+        handler_calls = 0;
+
+        std::string cases;
+        for (size_t i = 0; i < cfg.blocks.size(); i++) {
+            const cfg_block &b = cfg.blocks[i];
+            append(cases, "        case 0x%03X: goto L%03X;\n", b.start, b.start);
+            append(body, "\nL%03X:\n    if (cycles < %d || !live[%zu]) { c.pc = 0x%03X; return cycles; }\n    cycles -= %d;\n",
+                b.start, b.count, i, b.start, b.count);
+            for (WORD a = b.start; a < b.end; a += instruction_size(c.kind_at(a)))
+                instruction(a, a == b.last);
+        }
+
+        size_t image_size = 0;
+        for (const cfg_block &b : cfg.blocks)
+            image_size = std::max(image_size, (size_t)(b.start + b.bytes));
+
+        std::string out;
+        append(out, "// Translated from %s for the %s profile by recomp, run it again instead of editing this.\n", path.c_str(), variant_name(v));
+        append(out, "// %zu blocks, %d handler calls. See aot.h.\n", cfg.blocks.size(), handler_calls);
+        out += "#include \"../headers/aot.h\"\n\nnamespace {\n\n";
+        append(out, "struct %s;\n\n", tag.c_str());
+        append(out, "const BYTE image[%zu] = {", std::max(image_size, (size_t)1));
+        const BYTE *memory = c.state().memory;
+        for (size_t i = 0; i < image_size; i++)
+            append(out, "%s0x%02X,", i % 16 == 0 ? "\n    " : " ", memory[i]);
+        out += "\n};\n\n";
+        append(out, "const aot_block blocks[%zu] = {", std::max(cfg.blocks.size(), (size_t)1));
+        for (size_t i = 0; i < cfg.blocks.size(); i++)
+            append(out, "%s{0x%03X, %d},", i % 8 == 0 ? "\n    " : " ", cfg.blocks[i].start, cfg.blocks[i].bytes);
+        out += "\n};\n\n}\n\n";
+
+        append(out, "template <>\nstruct aot_code<%s> {\n    static int run(chip8 &c, const BYTE *live, int cycles);\n};\n\n", tag.c_str());
+        append(out, "int aot_code<%s>::run(chip8 &c, const BYTE *live, int cycles) {\n", tag.c_str());
+        out += "    BYTE *V = c.registers;\n";
+        if (handler_calls > 0) {
+            out += "    const chip8::handler *h = c.handler_table;\n";
+            out += "    static const chip8::instr ops[] = {\n" + ops + "    };\n";
+        }
+        out += "    (void)V;\n";
+        // only returns and computed jumps come back to the switch, a ROM without them leaves the label unused
+        bool redispatch = body.find("goto dispatch;") != std::string::npos;
+        out += std::string(redispatch ? "\ndispatch:\n" : "\n") + "    switch (c.pc) {\n" + cases + "        default: return cycles;\n    }\n";
+        out += body;
+        out += "}\n\n";
+
+        append(out, "static const aot_program program = {\n    0x%016llxull, %s, %s,\n    image, %zu, blocks, %zu,\n    &aot_code<%s>::run\n};\n",
+            (unsigned long long)hash, variant_enum(v), quoted(path).c_str(), image_size, cfg.blocks.size(), tag.c_str());
+        out += "static const aot_registration registered(program);\n";
+        return out;
+    }
+
+    static const char *variant_enum(Variant v) {
+        static const char *const names[VARIANTS] = {"VARIANT_DEFAULT", "VARIANT_VIP", "VARIANT_CHIP48", "VARIANT_SCHIP", "VARIANT_XOCHIP"};
+        return names[v];
+    }
+};
+
+int main(int argc, char **argv) {
+    options opt;
+    if (!parse_args(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    if (!resolve_roms(opt.roms, opt.variants))
+        return 1;
+    if (opt.force_variant)
+        opt.variants.assign(opt.roms.size(), opt.variant);
+    if (!opt.cfg) {
+        std::error_code ec;
+        std::filesystem::create_directories(opt.dir, ec);
+    }
+
+    int failures = 0;
+    // chip8 carries all of its memory inline, keep it off the stack
+    std::unique_ptr<chip8> c(new chip8());
+    for (size_t r = 0; r < opt.roms.size(); r++) {
+        const std::string &path = opt.roms[r];
+        std::vector<BYTE> rom;
+        c->set_variant(opt.variants[r]);
+        if (!read_rom(path, rom) || !c->load(rom.data(), rom.size())) {
+            std::cerr << "Error: could not load " << path << "\n";
+            failures++;
+            continue;
+        }
+        uint64_t hash = fnv1a(rom.data(), rom.size());
+        rom_cfg cfg;
+        cfg.build(*c, rom.size());
+
+        if (opt.cfg) {
+            printf("%s (%016llx, %s profile): %s", path.c_str(), (unsigned long long)hash, variant_name(opt.variants[r]),
+                cfg.listing(*c).c_str());
+            if (r + 1 < opt.roms.size())
+                printf("\n");
+            continue;
+        }
+
+        translator t(*c, cfg);
+        std::string file = opt.dir + "/" + hash_string(hash) + "-" + variant_name(opt.variants[r]) + ".cpp";
+        std::string text = t.translate(path, hash);
+        FILE *f = fopen(file.c_str(), "w");
+        bool ok = f != NULL && fwrite(text.data(), 1, text.size(), f) == text.size();
+        if (f == NULL || fclose(f) != 0 || !ok) {
+            std::cerr << "Error: could not write " << file << "\n";
+            failures++;
+            continue;
+        }
+        printf("%s: %zu blocks -> %s\n", path.c_str(), cfg.blocks.size(), file.c_str());
+    }
+    return failures == 0 ? 0 : 1;
+}
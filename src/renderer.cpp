@@ -0,0 +1,115 @@
+#include "../headers/renderer.h"
+#include "../headers/chip8.h"
+
+#include <cstring>
+
+const Uint32 WHITE = 0xFFFFFFFF;
+const Uint32 BLACK = 0xFF000000;
+
+// Indexed by the plane bits of a pixel, first plane in bit 0. 1 to 3 are the colours two plane
+// XO-CHIP games get, the rest only show up with all four planes.
+const Uint32 PALETTE[16] = {
+    BLACK,      WHITE,      0xFFFF6600, 0xFF999999,
+    0xFF1D2B53, 0xFF7E2553, 0xFF008751, 0xFFAB5236,
+    0xFF5F574F, 0xFFC2C3C7, 0xFFFFF1E8, 0xFFFF004D,
+    0xFFFFA300, 0xFFFFEC27, 0xFF00E436, 0xFF29ADFF
+};
+static_assert(PLANES == 4, "draw() combines exactly four planes into a palette index");
+
+renderer::~renderer() {
+    if (texture)
+        SDL_DestroyTexture(texture);
+}
+
+bool renderer::init(SDL_Renderer *r) {
+    sdl = r;
+    for (int b = 0; b < 256; b++) {
+        spread[b] = 0;
+        for (int i = 0; i < 8; i++)
+            spread[b] |= (uint32_t)((b >> (7 - i)) & 1) << (4 * i);
+    }
+    texture = SDL_CreateTexture(sdl, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, WIDTH, HEIGHT);
+    return texture != nullptr;
+}
+
+// Sends rows [first, last] of the pixel buffer to the texture in one call
+void renderer::upload_rows(int first, int last) {
+    SDL_Rect rect = {0, first, WIDTH, last - first + 1};
+    SDL_UpdateTexture(texture, &rect, &pixels[first*WIDTH], WIDTH * sizeof(Uint32));
+    changed = true;
+}
+
+// Converts and uploads the rows that changed, batching runs of neighbouring dirty rows
+void renderer::draw(const uint64_t (*display)[64][2], bool mode, uint64_t dirty_rows) {
+    // Coming back from a text screen, or a change of mode, means the whole game screen has to go back up
+    if (overlay || mode != hires) {
+        overlay = nullptr;
+        hires = mode;
+        forced_rows = ~0ull;
+    }
+    dirty_rows |= forced_rows;
+    forced_rows = 0;
+
+    int rows = hires ? 64 : 32;
+    int scale = hires ? 1 : 2;
+    int y = 0;
+    while (y < rows) {
+        if (!((dirty_rows >> y) & 1)) {
+            y++;
+            continue;
+        }
+        int first = y;
+        for (; y < rows && ((dirty_rows >> y) & 1); y++) {
+            // 8 pixels at a time: each plane's byte spread to a nibble per pixel, the four
+            // planes ORed in at their bit of the nibble, then one palette lookup per pixel
+            Uint32 *line = &pixels[y*scale*WIDTH];
+            for (int w = 0; w < (hires ? 2 : 1); w++) {
+                uint64_t p0 = display[0][y][w], p1 = display[1][y][w];
+                uint64_t p2 = display[2][y][w], p3 = display[3][y][w];
+                for (int b = 0; b < 8; b++) {
+                    int shift = 56 - 8*b;
+                    uint32_t index = spread[(p0 >> shift) & 0xFF] | spread[(p1 >> shift) & 0xFF] << 1
+                        | spread[(p2 >> shift) & 0xFF] << 2 | spread[(p3 >> shift) & 0xFF] << 3;
+                    Uint32 *out = line + (w*64 + b*8) * scale;
+                    for (int i = 0; i < 8; i++, index >>= 4) {
+                        if (hires)
+                            out[i] = PALETTE[index & 0xF];
+                        else
+                            out[2*i] = out[2*i+1] = PALETTE[index & 0xF];
+                    }
+                }
+            }
+            if (!hires)
+                memcpy(line + WIDTH, line, WIDTH * sizeof(Uint32));
+        }
+        upload_rows(first*scale, y*scale - 1);
+    }
+}
+
+// Text screens ('#' is lit, 64x32 like the game screen) are uploaded whole, but only when they
+// aren't already showing
+void renderer::draw(const std::string &screen) {
+    if (overlay == &screen)
+        return;
+    overlay = &screen;
+    for (int y = 0; y < 32; y++) {
+        Uint32 *line = &pixels[y*2*WIDTH];
+        for (int x = 0; x < 64; x++)
+            line[2*x] = line[2*x+1] = (screen[y*64+x] == '#') ? WHITE : BLACK;
+        memcpy(line + WIDTH, line, WIDTH * sizeof(Uint32));
+    }
+    upload_rows(0, HEIGHT - 1);
+}
+
+// Window got exposed or resized, the texture is intact but has to be presented again
+void renderer::invalidate() {
+    changed = true;
+}
+
+void renderer::present() {
+    if (!changed)
+        return;
+    SDL_RenderCopy(sdl, texture, NULL, NULL);
+    SDL_RenderPresent(sdl);
+    changed = false;
+}
@@ -0,0 +1,143 @@
+#include "../headers/rewind.h"
+
+#include <cstring>
+#include <algorithm>
+
+// Words are read and written through memcpy, machine_state is not an array of uint64_t
+static inline uint64_t word(const BYTE *s, size_t i) {
+    uint64_t w;
+    memcpy(&w, s + i * 8, 8);
+    return w;
+}
+
+rewind_buffer::rewind_buffer(int seconds, size_t arena_bytes) {
+    // Whole keyframe groups only, so frames[i] and keyframes[i / KEYFRAME_INTERVAL] wrap together
+    size_t groups = (seconds * 60 + KEYFRAME_INTERVAL - 1) / KEYFRAME_INTERVAL;
+    if (groups < 2)
+        groups = 2;
+    frames.resize(groups * KEYFRAME_INTERVAL);
+    keyframes.resize(groups);
+    // Worst case is every other word changed: a 4 byte token per changed word plus the word
+    scratch.resize(WORDS * 12 + 8);
+    arena.resize(arena_bytes < scratch.size() ? scratch.size() : arena_bytes);
+}
+
+/* Delta format
+A list of tokens, each a 16 bit count of unchanged words followed by a 16 bit count of changed
+words and then that many words of (state XOR keyframe). The tokens cover as many words as the
+keyframe has, past that both are 0.
+*/
+size_t rewind_buffer::encode(const BYTE *s, const BYTE *key, size_t words) {
+    BYTE *out = scratch.data();
+    size_t i = 0;
+    while (i < words) {
+        size_t first = i;
+        while (i < words && word(s, i) == word(key, i))
+            i++;
+        uint16_t skip = (uint16_t)(i - first);
+
+        BYTE *header = out;
+        out += 4;
+        first = i;
+        while (i < words && word(s, i) != word(key, i)) {
+            uint64_t x = word(s, i) ^ word(key, i);
+            memcpy(out, &x, 8);
+            out += 8;
+            i++;
+        }
+        uint16_t literals = (uint16_t)(i - first);
+        memcpy(header, &skip, 2);
+        memcpy(header + 2, &literals, 2);
+    }
+    return out - scratch.data();
+}
+
+void rewind_buffer::decode(size_t slot, machine_state &out) const {
+    const frame &f = frames[slot];
+    const std::vector<BYTE> &key = keyframes[slot / KEYFRAME_INTERVAL];
+    BYTE *dst = reinterpret_cast<BYTE *>(&out);
+    memcpy(dst, key.data(), key.size());
+    memset(dst + key.size(), 0, sizeof(machine_state) - key.size());
+    const BYTE *in = &arena[f.offset], *end = in + f.length;
+    size_t i = 0;
+    while (in < end) {
+        uint16_t skip, literals;
+        memcpy(&skip, in, 2);
+        memcpy(&literals, in + 2, 2);
+        in += 4;
+        i += skip;
+        for (uint16_t n = 0; n < literals; n++, i++, in += 8) {
+            uint64_t x;
+            memcpy(&x, in, 8);
+            x ^= word(dst, i);
+            memcpy(dst + i * 8, &x, 8);
+        }
+    }
+}
+
+bool rewind_buffer::overlaps(const frame &f, size_t offset, size_t length) const {
+    return f.offset < offset + length && offset < f.offset + f.length;
+}
+
+// Records the state at the end of one frame. Everything in s past its first size bytes has to
+// be 0, chip8::state_size() gives the most that can't be skipped.
+void rewind_buffer::push(const machine_state &s, size_t size) {
+    size_t n = frames.size();
+    if (count > 0)
+        head = (head + 1) % n;
+    size = std::min((size + 7) & ~(size_t)7, sizeof(machine_state));
+    const BYTE *bytes = reinterpret_cast<const BYTE *>(&s);
+
+    // A new group, or the first frame after a clear, starts from a copy and needs no delta. A
+    // state that reaches further than its keyframe is compared against 0s there, and one that
+    // stops short still has to undo whatever the keyframe has past its end.
+    size_t length = 0;
+    std::vector<BYTE> &key = keyframes[head / KEYFRAME_INTERVAL];
+    if (head % KEYFRAME_INTERVAL == 0 || count == 0) {
+        key.assign(bytes, bytes + size);
+    } else {
+        if (key.size() < size)
+            key.resize(size);
+        length = encode(bytes, key.data(), key.size() / 8);
+    }
+
+    // The frames still in the group being overwritten hang off the keyframe that was just
+    // replaced, so at most one group short of a full ring is ever restorable
+    count++;
+    if (count > n - KEYFRAME_INTERVAL)
+        count = n - KEYFRAME_INTERVAL;
+
+    // Deltas never straddle the end of the arena. Whatever is left past the cursor when it
+    // wraps belongs to the oldest frames, so those go first.
+    if (cursor + length > arena.size()) {
+        while (count > 1 && frames[(head + n - count + 1) % n].offset >= cursor)
+            count--;
+        cursor = 0;
+    }
+    while (count > 1 && overlaps(frames[(head + n - count + 1) % n], cursor, length))
+        count--;
+
+    if (length > 0)
+        memcpy(&arena[cursor], scratch.data(), length);
+    frames[head].offset = cursor;
+    frames[head].length = length;
+    cursor += length;
+}
+
+// Drops the newest frame and gives back the one before it, which becomes the newest. Fails
+// when there is nothing older left to go back to.
+bool rewind_buffer::step_back(machine_state &out) {
+    if (count < 2)
+        return false;
+    head = (head + frames.size() - 1) % frames.size();
+    count--;
+    decode(head, out);
+    return true;
+}
+
+size_t rewind_buffer::memory_used() const {
+    size_t keyframe_bytes = 0;
+    for (const std::vector<BYTE> &key : keyframes)
+        keyframe_bytes += key.capacity();
+    return frames.size() * sizeof(frame) + keyframe_bytes + arena.size() + scratch.size();
+}
@@ -0,0 +1,94 @@
+#include "../headers/thread_pool.h"
+
+thread_pool::thread_pool(size_t threads) {
+    if (threads == 0)
+        threads = 1;
+
+    for (size_t i = 0; i < threads; i++)
+        queues.push_back(std::make_unique<worker_queue>());
+
+    for (size_t i = 0; i < threads; i++)
+        workers.emplace_back(&thread_pool::worker_loop, this, i);
+}
+
+thread_pool::~thread_pool() {
+    {
+        std::lock_guard<std::mutex> guard(idle_lock);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (std::thread &t : workers)
+        t.join();
+}
+
+void thread_pool::submit(std::function<void()> job) {
+    size_t id;
+    {
+        std::lock_guard<std::mutex> guard(idle_lock);
+        pending++;
+        id = next_queue++ % queues.size();
+    }
+    {
+        std::lock_guard<std::mutex> guard(queues[id]->lock);
+        queues[id]->jobs.push_back(std::move(job));
+    }
+    {
+        // Counted only once the job is in a deque, so a worker woken for it finds it. Raised
+        // under idle_lock so a worker about to sleep can't miss it.
+        std::lock_guard<std::mutex> guard(idle_lock);
+        queued++;
+    }
+    work_ready.notify_all();
+}
+
+// Blocks until every submitted job has finished
+void thread_pool::wait() {
+    std::unique_lock<std::mutex> guard(idle_lock);
+    all_done.wait(guard, [this] { return pending == 0; });
+}
+
+// Own jobs come off the front...
+bool thread_pool::pop_local(size_t id, std::function<void()> &job) {
+    std::lock_guard<std::mutex> guard(queues[id]->lock);
+    if (queues[id]->jobs.empty())
+        return false;
+    job = std::move(queues[id]->jobs.front());
+    queues[id]->jobs.pop_front();
+    queued--;
+    return true;
+}
+
+// ...stolen jobs come off the back, so the owner and the thief rarely want the same job
+bool thread_pool::steal(size_t id, std::function<void()> &job) {
+    for (size_t i = 1; i < queues.size(); i++) {
+        worker_queue &victim = *queues[(id + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.jobs.empty()) {
+            job = std::move(victim.jobs.back());
+            victim.jobs.pop_back();
+            queued--;
+            steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void thread_pool::worker_loop(size_t id) {
+    for (;;) {
+        std::function<void()> job;
+        if (pop_local(id, job) || steal(id, job)) {
+            job();
+            std::lock_guard<std::mutex> guard(idle_lock);
+            if (--pending == 0)
+                all_done.notify_all();
+            continue;
+        }
+
+        // Nothing to run or steal, sleep until more work shows up
+        std::unique_lock<std::mutex> guard(idle_lock);
+        work_ready.wait(guard, [this] { return stopping || queued > 0; });
+        if (stopping)
+            return;
+    }
+}
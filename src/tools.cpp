@@ -0,0 +1,95 @@
+#include "../headers/tools.h"
+#include "../headers/library.h"
+
+#include <iostream>
+#include <filesystem>
+
+bool resolve_roms(std::vector<std::string> &roms, std::vector<Variant> &variants) {
+    rom_library library;
+    library.open();
+    // Paths need no scan, so scripted runs on given files start straight away
+    bool all_paths = !roms.empty();
+    for (const std::string &rom : roms)
+        all_paths = all_paths && std::filesystem::is_regular_file(rom);
+    if (!all_paths)
+        library.scan();
+    variants.clear();
+    if (roms.empty()) {
+        for (const rom_entry &e : library.roms()) {
+            roms.push_back(e.path);
+            variants.push_back(rom_variant(e));
+        }
+        if (roms.empty())
+            std::cerr << "Error: no ROMs in " << LIBRARY_DIRS[0] << "/, " << LIBRARY_DIRS[1] << "/ or " << LIBRARY_CONFIG << "\n";
+    }
+    else {
+        for (std::string &rom : roms) {
+            std::string error;
+            const rom_entry *e = library.find(rom, error);
+            if (e == nullptr) {
+                std::cerr << "Error: " << error << "\n";
+                return false;
+            }
+            rom = e->path;
+            variants.push_back(rom_variant(*e));
+        }
+    }
+    library.save();
+    return !roms.empty();
+}
+
+bool read_rom(const std::string &path, std::vector<BYTE> &rom) {
+    rom_file file;
+    if (!file.open(path))
+        return false;
+    rom.assign(file.data(), file.data() + file.size());
+    return true;
+}
+
+const char *engine_name(Engine e) {
+    switch (e) {
+        case ENGINE_INTERPRETER:    return "interpreter";
+        case ENGINE_THREADED:       return "threaded";
+        case ENGINE_JIT:            return "jit";
+        case ENGINE_AOT:            return "aot";
+        default:                    return "?";
+    }
+}
+
+bool parse_engine(const std::string &name, Engine &e) {
+    if (name == "interpreter")      e = ENGINE_INTERPRETER;
+    else if (name == "threaded")    e = ENGINE_THREADED;
+    else if (name == "jit")         e = ENGINE_JIT;
+    else if (name == "aot")         e = ENGINE_AOT;
+    else                            return false;
+    return true;
+}
+
+// FNV-1a over the display, enough to tell whether two runs ended up on the same screen. Only
+// the words the current mode uses, and only the planes after the first that have something on
+// them, so 64x32 CHIP-8 screens hash the same as they always did.
+uint64_t display_hash(const chip8 &c) {
+    uint64_t hash = 14695981039346656037ull;
+    int rows = c.hires ? 64 : 32, words = c.hires ? 2 : 1;
+    for (int p = 0; p < PLANES; p++) {
+        uint64_t any = 0;
+        for (int y = 0; y < rows; y++)
+            any |= c.display[p][y][0] | c.display[p][y][1];
+        if (p > 0 && any == 0)
+            continue;
+        if (p > 0) {
+            hash ^= p;
+            hash *= 1099511628211ull;
+        }
+        for (int y = 0; y < rows; y++) {
+            for (int w = 0; w < words; w++) {
+                // most significant byte first, so the hash doesn't depend on host byte order
+                for (int b = 56; b >= 0; b -= 8) {
+                    hash ^= (c.display[p][y][w] >> b) & 0xFF;
+                    hash *= 1099511628211ull;
+                }
+            }
+        }
+    }
+    return hash;
+}
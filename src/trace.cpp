@@ -0,0 +1,117 @@
+#include "../headers/trace.h"
+#include "../headers/disasm.h"
+
+#include <cstdio>
+#include <cstring>
+
+static const char *const level_names[TRACE_LEVELS] = {"off", "error", "warn", "info"};
+
+void trace_ring::log(int lvl, int event, WORD pc, WORD a, WORD b) {
+    if (logged > 0) {
+        trace_record &last = ring[(logged - 1) % SIZE];
+        if (last.event == event && last.pc == pc && last.a == a && last.b == b) {
+            last.repeat++;
+            return;
+        }
+    }
+    trace_record &r = ring[logged % SIZE];
+    r.seq = logged++;
+    r.repeat = 0;
+    r.event = (BYTE)event;
+    r.level = (BYTE)lvl;
+    r.pc = pc;
+    r.a = a;
+    r.b = b;
+}
+
+// Oldest first
+std::vector<trace_record> trace_ring::records() const {
+    uint32_t count = logged < SIZE ? logged : SIZE;
+    std::vector<trace_record> out;
+    out.reserve(count);
+    for (uint32_t i = logged - count; i != logged; i++)
+        out.push_back(ring[i % SIZE]);
+    return out;
+}
+
+bool trace_ring::save(const std::string &path) const {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f == NULL)
+        return false;
+    std::vector<trace_record> out = records();
+    uint32_t count = (uint32_t)out.size();
+    bool ok = fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC), 1, f) == 1
+        && fwrite(&TRACE_VERSION, sizeof(TRACE_VERSION), 1, f) == 1
+        && fwrite(&count, sizeof(count), 1, f) == 1
+        && (count == 0 || fwrite(out.data(), sizeof(trace_record), count, f) == count);
+    return fclose(f) == 0 && ok;
+}
+
+bool trace_ring::load(const std::string &path, std::vector<trace_record> &out) {
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL)
+        return false;
+    char magic[4];
+    uint32_t version, count;
+    bool ok = fread(magic, sizeof(magic), 1, f) == 1
+        && memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0
+        && fread(&version, sizeof(version), 1, f) == 1
+        && version == TRACE_VERSION
+        && fread(&count, sizeof(count), 1, f) == 1
+        && count <= SIZE;
+    if (ok) {
+        out.resize(count);
+        ok = count == 0 || fread(out.data(), sizeof(trace_record), count, f) == count;
+    }
+    fclose(f);
+    return ok;
+}
+
+const char *trace_level_name(int level) {
+    return level >= 0 && level < TRACE_LEVELS ? level_names[level] : "?";
+}
+
+bool parse_trace_level(const std::string &name, int &level) {
+    for (int l = 0; l < TRACE_LEVELS; l++) {
+        if (name == level_names[l]) {
+            level = l;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string describe(const trace_record &r) {
+    static const char *const load_errors[] = {"could not open it", "too large to fit in memory", "could not read all of it"};
+    char line[160];
+    int n = snprintf(line, sizeof(line), "#%u %-5s 0x%03X  ", r.seq, trace_level_name(r.level), r.pc);
+    char *rest = line + n;
+    size_t room = sizeof(line) - n;
+    switch (r.event) {
+        case TR_INVALID_OPCODE:
+        snprintf(rest, room, "invalid opcode %04X (%s)", r.a, disassemble(r.a).c_str());
+        break;
+        case TR_STACK_UNDERFLOW:
+        snprintf(rest, room, "return with an empty stack");
+        break;
+        case TR_STACK_OVERFLOW:
+        snprintf(rest, room, "call to 0x%03X overflowed the 16 entry stack", r.a);
+        break;
+        case TR_MEMORY_RANGE:
+        snprintf(rest, room, "%u bytes at I=0x%03X run past the end of memory and wrap", r.b, r.a);
+        break;
+        case TR_ROM_LOADED:
+        snprintf(rest, room, "loaded a %u byte ROM", r.a);
+        break;
+        case TR_ROM_FAILED:
+        snprintf(rest, room, "ROM of %u bytes not loaded, %s", r.a, r.b < 3 ? load_errors[r.b] : "unknown error");
+        break;
+        default:
+        snprintf(rest, room, "unknown event %u (a=%04X b=%04X)", r.event, r.a, r.b);
+        break;
+    }
+    std::string out = line;
+    if (r.repeat)
+        out += " (x" + std::to_string(r.repeat + 1) + ")";
+    return out;
+}
@@ -0,0 +1,48 @@
+#include "../headers/trace.h"
+
+#include <iostream>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/* Trace decoder
+Usage: tracedump [--level LEVEL] file ...
+Prints the records in trace files saved by the emulator or the headless runner, oldest first,
+one line each. --level hides records less severe than LEVEL (error, warn or info).
+*/
+
+int main(int argc, char **argv) {
+    int level = TRACE_INFO;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--level" && i + 1 < argc) {
+            if (!parse_trace_level(argv[++i], level)) {
+                std::cerr << "Error: unknown level " << argv[i] << "\n";
+                return 1;
+            }
+        }
+        else
+            files.push_back(arg);
+    }
+    if (files.empty()) {
+        std::cerr << "Usage: tracedump [--level error|warn|info] file ...\n";
+        return 1;
+    }
+
+    int failures = 0;
+    for (const std::string &path : files) {
+        std::vector<trace_record> records;
+        if (!trace_ring::load(path, records)) {
+            std::cerr << "Error: " << path << " is not a trace file\n";
+            failures++;
+            continue;
+        }
+        if (files.size() > 1)
+            printf("%s:\n", path.c_str());
+        for (const trace_record &r : records)
+            if (r.level <= level)
+                printf("%s\n", describe(r).c_str());
+    }
+    return failures == 0 ? 0 : 1;
+}